@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "SimAST.h"
+#include "SimAST2IR.h"
+#include "SimAST2LLVM.h"
+#include "SimEngine.h"
+
+using namespace XPUSchedulerSimulator;
+
+/*
+  Synthetic .arc workloads. Every kind stresses one shape of program, and
+  `size` scales it:
+
+    chain     one arrow chain of `size` operators
+    fanout    a source, `size` parallel operators and a sink (fan-out and
+              fan-in through shared names)
+    nested    `size` levels of foreach(2) inside one flow
+    hardware  `size` hardware classes, two operators and a flow on each,
+              the flows called in a chain
+
+  simu calls the top flow `calls` times, so the runtime phases register
+  `calls` times the instances of one call.
+*/
+struct BenchWorkload {
+  std::string kind;
+  int32_t size;
+  int32_t calls;
+
+  std::string Name() const { return kind + "_" + std::to_string(size); }
+  std::string Generate() const;
+};
+
+std::string BenchWorkload::Generate() const {
+  std::ostringstream arc;
+  auto Simu = [&](const char *flow) {
+    arc << "simu = {\n  foreach(" << calls << ") {\n    " << flow
+        << "();\n    sleep(10us);\n  };\n};\n";
+  };
+
+  if (kind == "hardware") {
+    arc << "hardware = [\n";
+    for (int32_t i = 0; i < size; i++) {
+      arc << "  HW" << i << "(" << 1 + i % 4 << "),\n";
+    }
+    arc << "];\noperator = [\n";
+    for (int32_t i = 0; i < size; i++) {
+      arc << "  load" << i << "(HW" << i << ", " << 1 + i % 7 << "us),\n"
+          << "  compute" << i << "(HW" << i << ", " << 1 + i % 5 << "us),\n";
+    }
+    arc << "];\n";
+    for (int32_t i = 0; i < size; i++) {
+      arc << "stage" << i << " = {\n  load" << i << " -> compute" << i
+          << ";\n};\n";
+    }
+    arc << "top = {\n  ";
+    for (int32_t i = 0; i < size; i++) {
+      arc << (i == 0 ? "" : " -> ") << "stage" << i;
+    }
+    arc << ";\n};\n";
+    Simu("top");
+    return arc.str();
+  }
+
+  arc << "hardware = [\n  CPU(8),\n  NPU(4),\n  DMA(2),\n];\n"
+         "operator = [\n  load(DMA, 3us),\n  compute(NPU, 5us),\n"
+         "  reduce(CPU, 2us),\n  store(DMA, 1us),\n";
+  if (kind == "chain" || kind == "fanout") {
+    const char *hardware[] = {"CPU", "NPU", "DMA"};
+    for (int32_t i = 0; i < size; i++) {
+      arc << "  op" << i << "(" << hardware[i % 3] << ", " << 1 + i % 5
+          << "us),\n";
+    }
+  }
+  arc << "];\n";
+
+  if (kind == "chain") {
+    arc << "top = {\n  load";
+    for (int32_t i = 0; i < size; i++) {
+      arc << " -> op" << i;
+    }
+    arc << " -> store;\n};\n";
+  } else if (kind == "fanout") {
+    arc << "top = {\n";
+    for (int32_t i = 0; i < size; i++) {
+      arc << "  load -> op" << i << " -> store;\n";
+    }
+    arc << "};\n";
+  } else if (kind == "nested") {
+    arc << "top = {\n  load -> ";
+    for (int32_t i = 0; i < size; i++) {
+      arc << "foreach(2) { compute -> ";
+    }
+    arc << "reduce;";
+    for (int32_t i = 0; i < size; i++) {
+      arc << " }";
+      arc << (i + 1 < size ? ";" : "");
+    }
+    arc << " -> store;\n};\n";
+  } else {
+    throw std::logic_error("unknown workload " + kind);
+  }
+  Simu("top");
+  return arc.str();
+}
+
+// counts what codegen writes instead of keeping it
+class CountingBuf : public std::streambuf {
+public:
+  uint64_t size = 0;
+
+protected:
+  std::streamsize xsputn(const char *, std::streamsize n) override {
+    size += n;
+    return n;
+  }
+  int_type overflow(int_type c) override {
+    if (c != traits_type::eof()) {
+      size++;
+    }
+    return c;
+  }
+};
+
+// one timed phase of one workload; seconds are the best of all repeats
+struct BenchResult {
+  std::string workload;
+  std::string phase;
+  double seconds;
+  double meanSeconds;
+  // what the phase processed: bytes, tokens or instances
+  uint64_t items;
+  std::string unit;
+};
+
+// runs body `repeat` times, body returns the items it processed; prepare
+// runs untimed before every body
+static BenchResult Measure(const BenchWorkload &workload,
+                           const std::string &phase, const std::string &unit,
+                           int32_t repeat,
+                           const std::function<uint64_t()> &body,
+                           const std::function<void()> &prepare = nullptr) {
+  BenchResult result{workload.Name(), phase, 0, 0, 0, unit};
+  double total = 0;
+  for (int32_t i = 0; i < repeat; i++) {
+    if (prepare) {
+      prepare();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    result.items = body();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count();
+    total += seconds;
+    result.seconds = i == 0 ? seconds : std::min(result.seconds, seconds);
+  }
+  result.meanSeconds = total / repeat;
+  return result;
+}
+
+/*
+  Times the phases of one workload, in pipeline order:
+
+    lex            SIMLexTokens, scanning without parsing
+    parse          GenSimAST, lexing included
+    lower          LowerTaskGraph
+    emit_des       SIMIRBuilder::AST2DESIR, lowering included
+    emit_wallclock SIMIRBuilder::AST2CPPIR, lowering included
+    run            SIMEngine::Run, the in-process discrete-event runtime
+    jit_compile    SIMLLVMBuilder::AST2LLVMIR and Optimize (--jit)
+    jit_run        SIMLLVMBuilder::JITRun (--jit)
+    des_binary     the emitted des simulator, compiled with --cxx and run
+                   as a process (--cxx)
+*/
+static void RunWorkload(const BenchWorkload &workload, int32_t repeat,
+                        int32_t jobs, bool jit, const std::string &cxx,
+                        const std::string &emitDir,
+                        std::vector<BenchResult> &results) {
+  std::string text = workload.Generate();
+  SIMSource source(text);
+  if (!emitDir.empty()) {
+    std::filesystem::create_directories(emitDir);
+    std::ofstream(std::filesystem::path(emitDir) / (workload.Name() + ".arc"))
+        << text;
+  }
+
+  results.push_back(Measure(workload, "lex", "tokens", repeat, [&] {
+    int64_t cnt = SIMLexTokens(source);
+    if (cnt < 0) {
+      throw std::logic_error("cannot create the scanner");
+    }
+    return (uint64_t)cnt;
+  }));
+  results.push_back(Measure(workload, "parse", "bytes", repeat, [&] {
+    SIMTranslationUnit *unit = GenSimAST(source);
+    if (unit == nullptr) {
+      throw std::logic_error(workload.Name() + " does not parse");
+    }
+    delete unit;
+    return (uint64_t)text.size();
+  }));
+
+  std::unique_ptr<SIMTranslationUnit> unit(GenSimAST(source));
+  SIMTaskGraph graph;
+  uint64_t nodeCnt = 0;
+  results.push_back(Measure(workload, "lower", "nodes", repeat, [&] {
+    graph = LowerTaskGraph(unit.get(), jobs);
+    nodeCnt = 0;
+    for (auto &flow : graph.flows) {
+      nodeCnt += flow.nodes.size();
+    }
+    return nodeCnt;
+  }));
+  for (const char *phase : {"emit_des", "emit_wallclock"}) {
+    results.push_back(Measure(workload, phase, "bytes", repeat, [&] {
+      CountingBuf buf;
+      std::ostream os(&buf);
+      SIMIRBuilder builder;
+      builder.jobs = jobs;
+      if (std::string(phase) == "emit_des") {
+        builder.AST2DESIR(unit.get(), os);
+      } else {
+        builder.AST2CPPIR(unit.get(), os);
+      }
+      return buf.size;
+    }));
+  }
+  uint64_t instanceCnt = 0;
+  results.push_back(Measure(workload, "run", "instances", repeat, [&] {
+    SIMEngine engine(graph);
+    instanceCnt = engine.Run().instanceCnt;
+    return instanceCnt;
+  }));
+
+  if (jit) {
+    // JITRun takes the module over, so every run needs a compile of its own
+    std::unique_ptr<SIMLLVMBuilder> builder;
+    auto Compile = [&] {
+      builder = std::make_unique<SIMLLVMBuilder>();
+      builder->jobs = jobs;
+      builder->AST2LLVMIR(unit.get());
+      builder->Optimize();
+    };
+    results.push_back(Measure(workload, "jit_compile", "nodes", repeat, [&] {
+      Compile();
+      return nodeCnt;
+    }));
+    results.push_back(Measure(
+        workload, "jit_run", "instances", repeat,
+        [&] {
+          uint64_t cnt = builder->JITRun().instanceCnt;
+          builder.reset();
+          return cnt;
+        },
+        [&] {
+          if (builder == nullptr) {
+            Compile();
+          }
+        }));
+  }
+
+  if (!cxx.empty()) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                ("arcticflow_bench_" + workload.Name());
+    std::filesystem::create_directories(dir);
+    std::string cpp = (dir / "des.cpp").string();
+    std::string bin = (dir / "des").string();
+    {
+      std::ofstream os(cpp);
+      SIMIRBuilder builder;
+      builder.jobs = jobs;
+      builder.AST2DESIR(unit.get(), os);
+    }
+    std::string compile =
+        cxx + " -std=c++17 -O2 -pthread " + cpp + " -o " + bin;
+    if (std::system(compile.c_str()) != 0) {
+      throw std::logic_error("cannot compile " + cpp);
+    }
+    std::string command = bin + " > /dev/null";
+    results.push_back(Measure(workload, "des_binary", "instances", repeat, [&] {
+      if (std::system(command.c_str()) != 0) {
+        throw std::logic_error(bin + " failed");
+      }
+      return instanceCnt;
+    }));
+    std::filesystem::remove_all(dir);
+  }
+}
+
+static void WriteJSON(const std::vector<BenchResult> &results,
+                      std::ostream &os) {
+  os << "{\"results\":[";
+  const char *separator = "\n";
+  for (auto &result : results) {
+    os << separator << "{\"workload\":\"" << result.workload
+       << "\",\"phase\":\"" << result.phase
+       << "\",\"seconds\":" << result.seconds
+       << ",\"mean_seconds\":" << result.meanSeconds
+       << ",\"items\":" << result.items << ",\"unit\":\"" << result.unit
+       << "\",\"items_per_second\":"
+       << (result.seconds > 0 ? result.items / result.seconds : 0) << "}";
+    separator = ",\n";
+  }
+  os << "\n]}\n";
+}
+
+static void WriteCSV(const std::vector<BenchResult> &results,
+                     std::ostream &os) {
+  os << "workload,phase,seconds,mean_seconds,items,unit,items_per_second\n";
+  for (auto &result : results) {
+    os << result.workload << "," << result.phase << "," << result.seconds
+       << "," << result.meanSeconds << "," << result.items << ","
+       << result.unit << ","
+       << (result.seconds > 0 ? result.items / result.seconds : 0) << "\n";
+  }
+}
+
+static void PrintUsage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--workload=chain|fanout|nested|hardware[:SIZE]]... "
+               "[--calls=N] [--repeat=N] [--jobs=N] [--jit] [--cxx=COMPILER] "
+               "[--format=json|csv] [-o FILE] [--emit-dir=DIR]"
+            << std::endl;
+  std::cerr << "  --workload=KIND:SIZE  generate and time one workload, may "
+               "be repeated; default: every kind at its default size"
+            << std::endl;
+  std::cerr << "  --calls=N             flow calls simu makes (default 100)"
+            << std::endl;
+  std::cerr << "  --repeat=N            runs of every phase, the best is "
+               "reported (default 5)"
+            << std::endl;
+  std::cerr << "  --jit                 also time the LLVM JIT" << std::endl;
+  std::cerr << "  --cxx=COMPILER        also compile the emitted des simulator "
+               "and time its process"
+            << std::endl;
+  std::cerr << "  --emit-dir=DIR        keep the generated .arc files in DIR"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::vector<BenchWorkload> workloads;
+  int32_t calls = 100;
+  int32_t repeat = 5;
+  int32_t jobs = 0;
+  bool jit = false;
+  std::string cxx, format = "json", outputPath, emitDir;
+  const std::vector<std::pair<std::string, int32_t>> defaultSizes = {
+      {"chain", 2000}, {"fanout", 2000}, {"nested", 10}, {"hardware", 200}};
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--workload=", 0) == 0) {
+      std::string spec = arg.substr(std::string("--workload=").size());
+      size_t colon = spec.find(':');
+      BenchWorkload workload{spec.substr(0, colon), 0, 0};
+      for (auto &[kind, size] : defaultSizes) {
+        if (kind == workload.kind) {
+          workload.size = size;
+        }
+      }
+      if (colon != std::string::npos) {
+        workload.size = std::atoi(spec.c_str() + colon + 1);
+      }
+      if (workload.size <= 0) {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+      workloads.push_back(workload);
+    } else if (arg.rfind("--calls=", 0) == 0) {
+      calls = std::atoi(arg.c_str() + std::string("--calls=").size());
+    } else if (arg.rfind("--repeat=", 0) == 0) {
+      repeat = std::atoi(arg.c_str() + std::string("--repeat=").size());
+    } else if (arg.rfind("--jobs=", 0) == 0) {
+      jobs = std::atoi(arg.c_str() + std::string("--jobs=").size());
+    } else if (arg == "--jit") {
+      jit = true;
+    } else if (arg.rfind("--cxx=", 0) == 0) {
+      cxx = arg.substr(std::string("--cxx=").size());
+    } else if (arg.rfind("--format=", 0) == 0) {
+      format = arg.substr(std::string("--format=").size());
+    } else if (arg.rfind("--emit-dir=", 0) == 0) {
+      emitDir = arg.substr(std::string("--emit-dir=").size());
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else {
+      PrintUsage(argv[0]);
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+  if (calls <= 0 || repeat <= 0 || jobs < 0 ||
+      (format != "json" && format != "csv")) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (workloads.empty()) {
+    for (auto &[kind, size] : defaultSizes) {
+      workloads.push_back({kind, size, 0});
+    }
+  }
+
+  std::vector<BenchResult> results;
+  try {
+    for (auto &workload : workloads) {
+      workload.calls = calls;
+      std::cerr << "bench " << workload.Name() << std::endl;
+      RunWorkload(workload, repeat, jobs, jit, cxx, emitDir, results);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::ofstream output;
+  if (!outputPath.empty()) {
+    output.open(outputPath);
+  }
+  std::ostream &os = outputPath.empty() ? std::cout : output;
+  if (format == "json") {
+    WriteJSON(results, os);
+  } else {
+    WriteCSV(results, os);
+  }
+  return os ? 0 : 1;
+}
@@ -1,5 +1,339 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "SimAST.h"
+#include "SimAST2IR.h"
+#include "SimAST2LLVM.h"
+#include "SimEngine.h"
+#include "SimPreProcessor.h"
+#include "SimSweep.h"
+
+using namespace XPUSchedulerSimulator;
+
+static void PrintUsage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " <input.arc> [-o output.cpp] [-I dir] "
+               "[--mode=wallclock|des|run|llvm|jit|sweep] [--window=N] "
+               "[--executor=threads|pool] [--scheduler=fifo|cp] [--jobs=N] "
+               "[--cache-dir=DIR] [--trace=FILE] [--metrics[=FILE]] "
+               "[--sweep=NAME=VALUES]... [--format=csv|json]"
+            << std::endl;
+  std::cerr << "  -I dir            search dir for #include files, may be "
+               "repeated"
+            << std::endl;
+  std::cerr << "  --mode=wallclock  emit a simulator that runs operators in "
+               "real time (default)"
+            << std::endl;
+  std::cerr << "  --mode=des        emit a deterministic discrete-event "
+               "simulator on a virtual clock"
+            << std::endl;
+  std::cerr << "  --mode=run        simulate in-process on a virtual clock, "
+               "no C++ is emitted"
+            << std::endl;
+  std::cerr << "  --mode=llvm       emit optimized LLVM IR for the flows and "
+               "simu"
+            << std::endl;
+  std::cerr << "  --mode=jit        run the LLVM IR with the ORC JIT, then "
+               "simulate in-process"
+            << std::endl;
+  std::cerr << "  --mode=sweep      simulate in-process once per combination "
+               "of the --sweep values, in parallel, and write one table"
+            << std::endl;
+  std::cerr << "  --window=N        in-flight instances of the wall-clock "
+               "simulator, overrides `window = N;`"
+            << std::endl;
+  std::cerr << "  --executor=pool   run wall-clock devices on a worker pool "
+               "sized to the host cores instead of one thread per device"
+            << std::endl;
+  std::cerr << "  --scheduler=cp    run ready instances on the longest "
+               "remaining path first instead of in ready order (fifo)"
+            << std::endl;
+  std::cerr << "  --jobs=N          threads flow blocks are lowered and "
+               "emitted on, default one per core"
+            << std::endl;
+  std::cerr << "  --cache-dir=DIR   reuse the C++ of unchanged flow blocks "
+               "from DIR (wallclock and des)"
+            << std::endl;
+  std::cerr << "  --trace=FILE      write a Chrome trace of every instance "
+               "to FILE (run and jit; the wallclock and des simulators "
+               "write it when they exit)"
+            << std::endl;
+  std::cerr << "  --metrics[=FILE]  report flow latency and ready queue "
+               "percentiles after the usage table, or as JSON to FILE"
+            << std::endl;
+  std::cerr << "  --sweep=NPU=1..64 device counts of a hardware, or times of "
+               "an operator (a=2us,4us or a=1us..8us:1us), may be repeated"
+            << std::endl;
+  std::cerr << "  --format=json     table format of --mode=sweep, default csv"
+            << std::endl;
+}
+
+// the file of -o
+static bool OpenOutput(std::ofstream &output, const std::string &path) {
+  output.open(path);
+  if (!output.is_open()) {
+    std::cerr << "Cannot open " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// what --trace and --metrics ask for of an in-process run
+static bool WriteReports(const SIMTaskGraph &graph,
+                         const SIMEngineResult &result,
+                         const std::string &tracePath, bool metrics,
+                         const std::string &metricsPath) {
+  auto Write = [&](const std::string &path, auto write) {
+    std::ofstream file(path);
+    (result.*write)(graph, file);
+    if (!file) {
+      std::cerr << "Cannot write " << path << std::endl;
+      return false;
+    }
+    return true;
+  };
+  if (metrics && metricsPath.empty()) {
+    std::cout << result.MetricsReport(graph);
+  }
+  return (tracePath.empty() ||
+          Write(tracePath, &SIMEngineResult::WriteChromeTrace)) &&
+         (metricsPath.empty() ||
+          Write(metricsPath, &SIMEngineResult::WriteMetricsJSON));
+}
 
 int main(int argc, char **argv) {
-  std::cout << "Hello ArcticFlow" << std::endl;
-}
\ No newline at end of file
+  std::string inputPath, outputPath, mode = "wallclock";
+  int32_t window = 0;
+  int32_t jobs = 0;
+  std::string cacheDir;
+  std::string tracePath;
+  bool metrics = false;
+  std::string metricsPath;
+  std::vector<std::string> sweepSpecs;
+  std::string format = "csv";
+  SIMPreProcessor preProcessor;
+  std::string executor = "threads";
+  SIMSchedulerPolicy scheduler = SIMSchedulerPolicy::Fifo;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--mode=", 0) == 0) {
+      mode = arg.substr(std::string("--mode=").size());
+    } else if (arg.rfind("--window=", 0) == 0) {
+      window = std::atoi(arg.c_str() + std::string("--window=").size());
+      if (window <= 0) {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (arg.rfind("--jobs=", 0) == 0) {
+      jobs = std::atoi(arg.c_str() + std::string("--jobs=").size());
+      if (jobs <= 0) {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (arg.rfind("--cache-dir=", 0) == 0) {
+      cacheDir = arg.substr(std::string("--cache-dir=").size());
+    } else if (arg.rfind("--trace=", 0) == 0) {
+      tracePath = arg.substr(std::string("--trace=").size());
+    } else if (arg == "--metrics") {
+      metrics = true;
+    } else if (arg.rfind("--metrics=", 0) == 0) {
+      metrics = true;
+      metricsPath = arg.substr(std::string("--metrics=").size());
+    } else if (arg.rfind("--sweep=", 0) == 0) {
+      sweepSpecs.emplace_back(arg.substr(std::string("--sweep=").size()));
+    } else if (arg.rfind("--format=", 0) == 0) {
+      format = arg.substr(std::string("--format=").size());
+    } else if (arg.rfind("--executor=", 0) == 0) {
+      executor = arg.substr(std::string("--executor=").size());
+    } else if (arg.rfind("--scheduler=", 0) == 0) {
+      try {
+        scheduler = ParseSchedulerPolicy(
+            arg.substr(std::string("--scheduler=").size()));
+      } catch (const std::logic_error &e) {
+        std::cerr << e.what() << std::endl;
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (arg == "-I" && i + 1 < argc) {
+      preProcessor.includeDirs.emplace_back(argv[++i]);
+    } else if (arg.rfind("-I", 0) == 0 && arg.size() > 2) {
+      preProcessor.includeDirs.emplace_back(arg.substr(2));
+    } else if (arg == "-h" || arg == "--help") {
+      PrintUsage(argv[0]);
+      return 0;
+    } else {
+      inputPath = arg;
+    }
+  }
+  if (inputPath.empty() ||
+      (mode != "wallclock" && mode != "des" && mode != "run" &&
+       mode != "llvm" && mode != "jit" && mode != "sweep") ||
+      (executor != "threads" && executor != "pool") ||
+      (format != "csv" && format != "json")) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  SIMSource source;
+  if (!source.Map(inputPath)) {
+    std::cerr << "Cannot open " << inputPath << ": " << std::strerror(errno)
+              << std::endl;
+    return 1;
+  }
+
+  SIMTranslationUnit *unit;
+  try {
+    preProcessor.Run(source);
+    unit = GenSimAST(preProcessor.Output());
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (unit == nullptr) {
+    return 1;
+  }
+
+  if (mode == "run") {
+    try {
+      SIMTaskGraph graph = LowerTaskGraph(unit, jobs);
+      SIMEngine engine(graph);
+      engine.policy = scheduler;
+      engine.trace = !tracePath.empty();
+      engine.metrics = metrics;
+      SIMEngineResult result = engine.Run();
+      std::cout << result.dump(graph);
+      if (!WriteReports(graph, result, tracePath, metrics, metricsPath)) {
+        delete unit;
+        return 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      delete unit;
+      return 1;
+    }
+    delete unit;
+    return 0;
+  }
+
+  if (mode == "sweep") {
+    try {
+      SIMTaskGraph graph = LowerTaskGraph(unit, jobs);
+      SIMSweep sweep(graph);
+      sweep.policy = scheduler;
+      sweep.jobs = jobs;
+      for (auto &spec : sweepSpecs) {
+        sweep.axes.emplace_back(ParseSweepAxis(graph, spec));
+      }
+      std::vector<SIMSweepVariant> variants = sweep.Run();
+      std::ofstream output;
+      if (!outputPath.empty() && !OpenOutput(output, outputPath)) {
+        delete unit;
+        return 1;
+      }
+      std::ostream &os = outputPath.empty() ? std::cout : output;
+      if (format == "json") {
+        sweep.WriteJSON(variants, os);
+      } else {
+        sweep.WriteCSV(variants, os);
+      }
+      if (!os) {
+        std::cerr << "Cannot write "
+                  << (outputPath.empty() ? "stdout" : outputPath) << std::endl;
+        delete unit;
+        return 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      delete unit;
+      return 1;
+    }
+    delete unit;
+    return 0;
+  }
+
+  if (mode == "llvm" || mode == "jit") {
+    try {
+      SIMLLVMBuilder builder;
+      builder.policy = scheduler;
+      builder.jobs = jobs;
+      builder.trace = mode == "jit" && !tracePath.empty();
+      builder.metrics = mode == "jit" && metrics;
+      builder.AST2LLVMIR(unit);
+      builder.Optimize();
+      if (mode == "jit") {
+        SIMEngineResult result = builder.JITRun();
+        std::cout << result.dump(builder.graph);
+        if (!WriteReports(builder.graph, result, tracePath, metrics,
+                          metricsPath)) {
+          delete unit;
+          return 1;
+        }
+      } else if (outputPath.empty()) {
+        std::cout << builder.dump();
+      } else {
+        std::ofstream output;
+        if (!OpenOutput(output, outputPath)) {
+          delete unit;
+          return 1;
+        }
+        output << builder.dump();
+        if (!output) {
+          std::cerr << "Cannot write " << outputPath << std::endl;
+          delete unit;
+          return 1;
+        }
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      delete unit;
+      return 1;
+    }
+    delete unit;
+    return 0;
+  }
+
+  std::ofstream output;
+  if (!outputPath.empty() && !OpenOutput(output, outputPath)) {
+    delete unit;
+    return 1;
+  }
+  std::ostream &os = outputPath.empty() ? std::cout : output;
+
+  SIMIRBuilder builder;
+  builder.instanceWindow = window;
+  builder.devicePool = executor == "pool";
+  builder.scheduler = scheduler;
+  builder.jobs = jobs;
+  builder.cacheDir = cacheDir;
+  builder.tracePath = tracePath;
+  builder.metrics = metrics;
+  builder.metricsPath = metricsPath;
+  try {
+    if (mode == "des") {
+      builder.AST2DESIR(unit, os);
+    } else {
+      builder.AST2CPPIR(unit, os);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    delete unit;
+    return 1;
+  }
+  os << std::endl;
+  delete unit;
+  if (!os) {
+    std::cerr << "Cannot write "
+              << (outputPath.empty() ? "stdout" : outputPath) << std::endl;
+    return 1;
+  }
+  return 0;
+}
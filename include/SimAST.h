@@ -1,32 +1,124 @@
 #ifndef __SIM_AST_H_
 #define __SIM_AST_H_
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include "SimSource.h"
+
+// one snprintf into a stack buffer, a second pass only for long results
 template <typename... Args>
 std::string StringFormat(const char *format, Args... args) {
-  size_t length = std::snprintf(nullptr, 0, format, args...);
+  char buf[256];
+  int length = std::snprintf(buf, sizeof(buf), format, args...);
   if (length <= 0) {
     return "";
   }
+  if (length < sizeof(buf)) {
+    return std::string(buf, length);
+  }
 
-  char *buf = new char[length + 1];
-  std::snprintf(buf, length + 1, format, args...);
-
-  std::string str(buf);
-  delete[] buf;
+  std::string str(length, '\0');
+  std::snprintf(&str[0], length + 1, format, args...);
   return str;
 }
 namespace XPUSchedulerSimulator {
 
 std::string SimASTDumpIndent(int32_t indent = 0);
 
+// nanoseconds in a duration literal, digits with an optional fraction and a
+// unit of ns, us, ms or s (ms without one); sub-nanosecond digits round.
+// -1 when it does not fit in 64 bits
+int64_t SIMParseDuration(std::string_view text);
+
+/*
+  Bump allocator the parser builds a whole SIMTranslationUnit from. Nodes
+  are never destroyed one by one: their vectors allocate from the arena too
+  (SIMArenaVector) and names live in the SIMSymbolTable, so dropping the
+  arena's chunks releases the whole tree at once.
+*/
+class SIMArena {
+public:
+  SIMArena() = default;
+  SIMArena(const SIMArena &) = delete;
+  SIMArena &operator=(const SIMArena &) = delete;
+
+  void *Allocate(size_t size, size_t align);
+
+  // nodes holding an SIMArenaVector take the arena in their constructor
+  template <typename T> T *New() {
+    void *mem = Allocate(sizeof(T), alignof(T));
+    if constexpr (std::is_constructible_v<T, SIMArena &>) {
+      return new (mem) T(*this);
+    } else {
+      return new (mem) T();
+    }
+  }
+
+private:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char *cur = nullptr;
+  char *end = nullptr;
+};
+
+// memory is only given back with the whole arena
+template <typename T> struct SIMArenaAllocator {
+  using value_type = T;
+  SIMArena *arena;
+
+  SIMArenaAllocator(SIMArena &arena) : arena(&arena) {}
+  template <typename U>
+  SIMArenaAllocator(const SIMArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->Allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+
+  template <typename U> bool operator==(const SIMArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+  template <typename U> bool operator!=(const SIMArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+};
+
+template <typename T>
+using SIMArenaVector = std::vector<T, SIMArenaAllocator<T>>;
+
+// interned identifier, one per distinct name, ids in order of first use
 struct SIMSymbol {
   std::string name;
-  virtual ~SIMSymbol() {}
+  int32_t id;
+};
+
+struct SIMSymbolTable {
+  SIMSymbol *Intern(std::string_view name);
+  size_t size() const { return symbols.size(); }
+
+private:
+  // a deque never moves its elements, so the keys can view into them
+  std::deque<SIMSymbol> symbols;
+  std::unordered_map<std::string_view, SIMSymbol *> index;
+};
+
+struct SIMSymbolLess {
+  bool operator()(const SIMSymbol *lhs, const SIMSymbol *rhs) const {
+    return lhs->id < rhs->id;
+  }
 };
 
 struct SIMFlowExpression {
@@ -35,7 +127,6 @@ struct SIMFlowExpression {
     return dynamic_cast<T>(this);
   }
   virtual std::string dump(int32_t indent = 0) { return ""; }
-  virtual ~SIMFlowExpression() {}
 };
 
 struct SIMFlowUnaryExpression : SIMFlowExpression {
@@ -44,24 +135,21 @@ struct SIMFlowUnaryExpression : SIMFlowExpression {
     return StringFormat("%s{SIMFlowUnaryExpression %s}\n",
                         SimASTDumpIndent(indent).c_str(), opName->name.c_str());
   }
-  virtual ~SIMFlowUnaryExpression() override {}
 };
 
-struct SIMFlowBinaryExpression : SIMFlowExpression {
-  SIMFlowExpression *leftExpr;
-  SIMFlowExpression *rightExpr;
+// `a -> b -> ...`, stages in source order, so chain length costs no depth
+struct SIMFlowChainExpression : SIMFlowExpression {
+  SIMArenaVector<SIMFlowExpression *> stages;
+  explicit SIMFlowChainExpression(SIMArena &arena) : stages(arena) {}
   std::string dump(int32_t indent = 0) override {
-    std::string ret = StringFormat("%s{SIMFlowBinaryExpression\n",
+    std::string ret = StringFormat("%s{SIMFlowChainExpression\n",
                                    SimASTDumpIndent(indent).c_str());
-    ret += StringFormat("%s", leftExpr->dump(indent + 2).c_str());
-    ret += StringFormat("%s", rightExpr->dump(indent + 2).c_str());
+    for (auto *stage : stages) {
+      ret += stage->dump(indent + 2);
+    }
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  virtual ~SIMFlowBinaryExpression() override {
-    delete leftExpr;
-    delete rightExpr;
-  }
 };
 
 struct SIMBlock {
@@ -70,11 +158,11 @@ struct SIMBlock {
     return dynamic_cast<T>(this);
   }
   virtual std::string dump(int32_t indent = 0) { return ""; }
-  virtual ~SIMBlock() {}
 };
 
 struct SIMFlowBlock : SIMBlock {
-  std::vector<SIMFlowExpression *> exprs;
+  SIMArenaVector<SIMFlowChainExpression *> exprs;
+  explicit SIMFlowBlock(SIMArena &arena) : exprs(arena) {}
   std::string dump(int32_t indent = 0) override {
     std::string ret =
         StringFormat("%s{SIMFlowBlock\n", SimASTDumpIndent(indent).c_str());
@@ -84,11 +172,6 @@ struct SIMFlowBlock : SIMBlock {
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  ~SIMFlowBlock() {
-    for (auto *expr : exprs) {
-      delete expr;
-    }
-  }
 };
 
 struct SIMExpression {
@@ -97,15 +180,15 @@ struct SIMExpression {
     return dynamic_cast<T>(this);
   }
   virtual std::string dump(int32_t indent = 0) { return ""; }
-  virtual ~SIMExpression() {}
 };
 
 struct SIMCallExpression : SIMExpression {
   SIMSymbol *name;
-  int32_t arg0;
+  // sleep: nanoseconds
+  int64_t arg0;
   std::string dump(int32_t indent = 0) override {
     if (name->name == "sleep") {
-      return StringFormat("%s{SIMCallExpression %s %d}\n",
+      return StringFormat("%s{SIMCallExpression %s %" PRId64 "}\n",
                           SimASTDumpIndent(indent).c_str(), name->name.c_str(),
                           arg0);
     } else {
@@ -113,11 +196,11 @@ struct SIMCallExpression : SIMExpression {
                           SimASTDumpIndent(indent).c_str(), name->name.c_str());
     }
   }
-  virtual ~SIMCallExpression() { delete name; }
 };
 
 struct SIMSimuBlock : SIMBlock {
-  std::vector<SIMExpression *> exprs;
+  SIMArenaVector<SIMExpression *> exprs;
+  explicit SIMSimuBlock(SIMArena &arena) : exprs(arena) {}
   std::string dump(int32_t indent = 0) override {
     std::string ret =
         StringFormat("%s{SIMSimuBlock\n", SimASTDumpIndent(indent).c_str());
@@ -127,11 +210,6 @@ struct SIMSimuBlock : SIMBlock {
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  ~SIMSimuBlock() {
-    for (auto *expr : exprs) {
-      delete expr;
-    }
-  }
 };
 
 struct SIMHardwareExpr {
@@ -142,11 +220,11 @@ struct SIMHardwareExpr {
                         SimASTDumpIndent(indent).c_str(),
                         hardwareName->name.c_str(), hardwareCnt);
   }
-  ~SIMHardwareExpr() { delete hardwareName; }
 };
 
 struct SIMHardwareBlock : SIMBlock {
-  std::vector<SIMHardwareExpr *> exprs;
+  SIMArenaVector<SIMHardwareExpr *> exprs;
+  explicit SIMHardwareBlock(SIMArena &arena) : exprs(arena) {}
   std::string dump(int32_t indent = 0) override {
     std::string ret =
         StringFormat("%s{SIMHardwareBlock\n", SimASTDumpIndent(indent).c_str());
@@ -157,30 +235,23 @@ struct SIMHardwareBlock : SIMBlock {
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  ~SIMHardwareBlock() {
-    for (auto *expr : exprs) {
-      delete expr;
-    }
-  }
 };
 
 struct SIMOperatorExpr {
   SIMSymbol *opName;
   SIMSymbol *hardwareName;
-  int32_t time;
+  // nanoseconds
+  int64_t time;
   std::string dump(int32_t indent = 0) {
-    return StringFormat("%s{SIMOperatorExpr %s %s %d}\n",
+    return StringFormat("%s{SIMOperatorExpr %s %s %" PRId64 "}\n",
                         SimASTDumpIndent(indent).c_str(), opName->name.c_str(),
                         hardwareName->name.c_str(), time);
   }
-  ~SIMOperatorExpr() {
-    delete opName;
-    delete hardwareName;
-  }
 };
 
 struct SIMOperatorBlock : SIMBlock {
-  std::vector<SIMOperatorExpr *> exprs;
+  SIMArenaVector<SIMOperatorExpr *> exprs;
+  explicit SIMOperatorBlock(SIMArena &arena) : exprs(arena) {}
   std::string dump(int32_t indent = 0) override {
     std::string ret =
         StringFormat("%s{SIMOperatorBlock\n", SimASTDumpIndent(indent).c_str());
@@ -191,10 +262,14 @@ struct SIMOperatorBlock : SIMBlock {
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  ~SIMOperatorBlock() {
-    for (auto *expr : exprs) {
-      delete expr;
-    }
+};
+
+// in-flight instance window of the wall-clock runtime
+struct SIMWindowBlock : SIMBlock {
+  int32_t size;
+  std::string dump(int32_t indent = 0) override {
+    return StringFormat("%s{SIMWindowBlock %d}\n",
+                        SimASTDumpIndent(indent).c_str(), size);
   }
 };
 
@@ -211,20 +286,30 @@ struct SIMForeachExpression : SIMExpression, SIMFlowExpression {
     ret += StringFormat("%s}\n", SimASTDumpIndent(indent).c_str());
     return ret;
   }
-  virtual ~SIMForeachExpression() override { delete loopBlock; }
 };
 
+/*
+  Owns every node of the program through `arena` and every name through
+  `symbols`; deleting the unit frees the tree without visiting it.
+*/
 struct SIMTranslationUnit {
-  SIMHardwareBlock *hardware;
-  SIMOperatorBlock *op;
-  SIMSimuBlock *simu;
-  std::map<SIMSymbol *, SIMFlowBlock *> flowBlocks;
+  SIMArena arena;
+  SIMSymbolTable symbols;
+  SIMHardwareBlock *hardware = nullptr;
+  SIMOperatorBlock *op = nullptr;
+  SIMSimuBlock *simu = nullptr;
+  SIMWindowBlock *window = nullptr;
+  // ordered by symbol id, so iteration does not depend on addresses
+  std::map<SIMSymbol *, SIMFlowBlock *, SIMSymbolLess> flowBlocks;
 
   std::string dump(int32_t indent = 0) {
     std::string str;
     str += hardware->dump(indent);
     str += op->dump(indent);
     str += simu->dump(indent);
+    if (window != nullptr) {
+      str += window->dump(indent);
+    }
     str += std::string("{FlowBlocks\n");
     for (auto &[sym, block] : flowBlocks) {
       str += sym->name + std::string(":\n");
@@ -233,22 +318,36 @@ struct SIMTranslationUnit {
     str += std::string("}");
     return str;
   }
+};
 
-  ~SIMTranslationUnit() {
-    delete hardware;
-    delete op;
-    delete simu;
-    for (auto &[sym, block] : flowBlocks) {
-      delete sym;
-      delete block;
-    }
+/*
+  State of one parse, shared by the reentrant scanner (as its extra data)
+  and the pure parser. Nothing is global, so any number of sources can be
+  parsed at once on different threads.
+*/
+struct SIMParseContext {
+  // built by the parser, names are interned into unit->symbols
+  SIMTranslationUnit *unit = nullptr;
+  const SIMSource *source = nullptr;
+  // next character of source the scanner has not read yet
+  size_t readPos = 0;
+  // name of the flow block being reduced
+  SIMSymbol *flowBlockName = nullptr;
+
+  // the scanner's YY_INPUT: copies the next chunk of source into buf
+  size_t Read(char *buf, size_t maxSize) {
+    size_t n = std::min(maxSize, source->Text().size() - readPos);
+    std::memcpy(buf, source->Text().data() + readPos, n);
+    readPos += n;
+    return n;
   }
 };
 
-extern const char *src;
-
+// nullptr on a syntax error, which is reported on stderr; thread-safe
+SIMTranslationUnit *GenSimAST(const SIMSource &source);
 SIMTranslationUnit *GenSimAST(const char *srcPtr);
-
-std::string GetSrc(int32_t lineno);
+// tokens the scanner reads from source without parsing them, -1 when the
+// scanner cannot be created; lets a benchmark time lexing on its own
+int64_t SIMLexTokens(const SIMSource &source);
 };  // namespace XPUSchedulerSimulator
 #endif
\ No newline at end of file
@@ -2,32 +2,113 @@
 #define __SIM_AST2IR_H_
 
 #include <cstdint>
+#include <cstdio>
 #include <map>
+#include <ostream>
 #include <string>
 #include <vector>
 
 #include "SimAST.h"
+#include "SimEngine.h"
+#include "SimFlowCache.h"
 
 namespace XPUSchedulerSimulator {
 
+/*
+  Buffered sink for the emitted C++. Text is appended to a fixed buffer that
+  is handed to the stream whenever it fills, so codegen holds at most one
+  buffer of output no matter how large the program is. Format prints
+  straight into the buffer instead of building a temporary string.
+*/
+struct SIMIRWriter {
+  void Open(std::ostream &os);
+  void Write(const char *data, size_t size);
+  void Flush();
+  SIMIRWriter &operator<<(const char *str);
+  SIMIRWriter &operator<<(const std::string &str);
+
+  template <typename... Args> void Format(const char *format, Args... args) {
+    int length =
+        std::snprintf(buf.data() + used, buf.size() - used, format, args...);
+    if (length < 0) {
+      return;
+    }
+    if (used + length < buf.size()) {
+      used += length;
+      return;
+    }
+    Flush();
+    if (static_cast<size_t>(length) < buf.size()) {
+      std::snprintf(buf.data(), buf.size(), format, args...);
+      used = length;
+    } else {
+      *this << StringFormat(format, args...);
+    }
+  }
+
+private:
+  std::ostream *sink = nullptr;
+  std::vector<char> buf;
+  size_t used = 0;
+};
+
 struct SIMIRBuilder {
-  std::string ir;
-
-  void AST2CPPIR(SIMTranslationUnit *unit);
-  std::string EmitIRHeader();
-  std::string EmitHardwareEnum(SIMTranslationUnit *unit);
-  std::string EmitHardwareCntMap(SIMTranslationUnit *unit);
-  std::string EmitOperatorFuncBody(SIMTranslationUnit *unit);
-  std::string EmitOpToTimeMap(SIMTranslationUnit *unit);
-  std::string EmitInstanceMap(SIMTranslationUnit *unit);
-  std::string EmitRegisterInstanceFunc(SIMTranslationUnit *unit);
-  std::string EmitFlowFunc(SIMTranslationUnit *unit);
-  std::string EmitSimuFunc(SIMTranslationUnit *unit);
-  std::string EmitSpinLockClass(SIMTranslationUnit *unit);
-  std::string EmitSimpleScheduler(SIMTranslationUnit *unit);
-  std::string EmitGreedyScheduler(SIMTranslationUnit *unit);
-  std::string EmitInstanceExecuteService(SIMTranslationUnit *unit);
-  std::string EmitMainFunc(SIMTranslationUnit *unit);
+  SIMIRWriter out;
+  // flows are emitted from the lowered graph, not from the AST
+  SIMTaskGraph graph;
+  // wall-clock in-flight window, 0: use the `window` block or 1024
+  int32_t instanceWindow = 0;
+  // wall-clock devices run on a core-sized worker pool, not a thread each
+  bool devicePool = false;
+  // order in which ready instances are handed to devices
+  SIMSchedulerPolicy scheduler = SIMSchedulerPolicy::Fifo;
+  // threads lowering and flow codegen run on, 0: one per core
+  int32_t jobs = 0;
+  // SIMFlowCache directory, empty: no cache
+  std::string cacheDir;
+  // the simulator writes a Chrome trace of every instance here, empty: no
+  // tracing code is emitted
+  std::string tracePath;
+  // the simulator keeps flow latency and ready queue histograms and prints
+  // them after the usage table, or writes them as JSON to metricsPath
+  bool metrics = false;
+  std::string metricsPath;
+
+  void AST2CPPIR(SIMTranslationUnit *unit, std::ostream &os);
+  // discrete-event simulation, runs on a virtual clock instead of wall time
+  void AST2DESIR(SIMTranslationUnit *unit, std::ostream &os);
+  // lowers every flow block that is not in the cache
+  void LowerFlows(SIMTranslationUnit *unit);
+  void EmitIRHeader();
+  void EmitClockFunc();
+  void EmitHardwareEnum(SIMTranslationUnit *unit);
+  void EmitHardwareCntMap(SIMTranslationUnit *unit);
+  void EmitOperatorFuncBody(SIMTranslationUnit *unit);
+  void EmitOpToTimeMap(SIMTranslationUnit *unit);
+  void EmitInstanceMap(SIMTranslationUnit *unit);
+  void EmitInstanceSlotTable(SIMTranslationUnit *unit);
+  void EmitBackpressure(SIMTranslationUnit *unit);
+  void EmitRegisterInstanceFunc(SIMTranslationUnit *unit);
+  void EmitFlowFunc(SIMTranslationUnit *unit);
+  void EmitSimuFunc(SIMTranslationUnit *unit);
+  void EmitLockFreeQueueClass(SIMTranslationUnit *unit);
+  void EmitScheduler(SIMTranslationUnit *unit);
+  void EmitHardwareExecuteFunc(SIMTranslationUnit *unit);
+  void EmitDevicePoolFunc(SIMTranslationUnit *unit);
+  void EmitInstanceExecuteService(SIMTranslationUnit *unit);
+  void EmitMainFunc(SIMTranslationUnit *unit);
+  void EmitTheoreticalTimeArray(SIMTranslationUnit *unit);
+  void EmitTraceFunc(SIMTranslationUnit *unit);
+  void EmitMetricsFunc(SIMTranslationUnit *unit);
+  void EmitVirtualRegisterInstanceFunc(SIMTranslationUnit *unit);
+  void EmitVirtualSimuFunc(SIMTranslationUnit *unit);
+  void EmitDiscreteEventScheduler(SIMTranslationUnit *unit);
+  void EmitDiscreteEventMainFunc(SIMTranslationUnit *unit);
+
+private:
+  SIMFlowCache cache;
+  // flow name -> emitted text of its block, for blocks found in the cache
+  std::map<std::string, std::string> cachedText;
 };
 
 } // namespace XPUSchedulerSimulator
@@ -0,0 +1,62 @@
+#ifndef __SIM_AST2LLVM_H_
+#define __SIM_AST2LLVM_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "SimAST.h"
+#include "SimEngine.h"
+
+namespace XPUSchedulerSimulator {
+
+/*
+  LLVM backend. Every flow becomes a function
+    void @"flow.<name>"(i8 *engine, i64 *preRanges, i64 rangeCnt,
+                        i64 tailRank)
+  and simu becomes `void @simu(i8 *engine)`; foreach turns into real loops.
+  The generated code registers instances through the SIMEngine driver
+  interface, so after the JIT has run simu the engine's event loop schedules
+  them exactly like --mode=run.
+*/
+struct SIMLLVMBuilder {
+  SIMTaskGraph graph;
+  std::unique_ptr<llvm::LLVMContext> context;
+  std::unique_ptr<llvm::Module> module;
+  SIMSchedulerPolicy policy = SIMSchedulerPolicy::Fifo;
+  // threads flow blocks are lowered on, 0: one per core
+  int32_t jobs = 0;
+  // passed on to the SIMEngine of JITRun; either makes simu report every
+  // flow it calls to the engine
+  bool trace = false, metrics = false;
+
+  void AST2LLVMIR(SIMTranslationUnit *unit);
+  // runs the default O2 pipeline on module
+  void Optimize();
+  std::string dump();
+  // hands module to an ORC LLJIT, runs simu and then the event loop
+  SIMEngineResult JITRun();
+
+private:
+  llvm::FunctionCallee registerInstanceFunc, instanceCntFunc, sleepFunc,
+      beginFlowFunc;
+  std::vector<llvm::Function *> flowFuncs;
+
+  void EmitRuntimeDecl();
+  void EmitFlowFunc(int32_t flow);
+  void EmitSimuFunc();
+  void EmitSimuSteps(llvm::IRBuilder<> &builder, llvm::Value *engine,
+                     int32_t begin, int32_t end);
+  void EmitRepeat(llvm::IRBuilder<> &builder, int32_t cnt,
+                  const std::function<void()> &body);
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef __SIM_ENGINE_H_
+#define __SIM_ENGINE_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "SimAST.h"
+
+namespace XPUSchedulerSimulator {
+
+/*
+  Runtime task graph lowered from a SIMTranslationUnit. Every name is resolved
+  to a dense id, so running it never touches the AST or a string again.
+*/
+struct SIMTaskGraph {
+  struct Hardware {
+    std::string name;
+    int32_t cnt;
+  };
+
+  struct Operator {
+    std::string name;
+    int32_t hardware;
+    int64_t time;
+  };
+
+  // one operator instance, or `repeat` calls of another flow template
+  struct Node {
+    std::string name;
+    int32_t op = -1;
+    int32_t flow = -1;
+    int32_t repeat = 1;
+    std::vector<int32_t> preNodes;
+    // upward rank inside the flow: cost of the node plus the longest path
+    // through its successors, in ns
+    uint64_t rank = 0;
+  };
+
+  // nodes are stored in registration order, predecessors always come first
+  struct Flow {
+    std::string name;
+    std::vector<Node> nodes;
+    // longest path through one call of the flow, in ns
+    uint64_t criticalPath = 0;
+    bool ranked = false;
+    // user flows only: the foreach bodies expanded from the flow's block
+    // are flows [foreachBegin, foreachEnd)
+    int32_t foreachBegin = 0, foreachEnd = 0;
+  };
+
+  struct SimuStep {
+    enum Kind { Call, Sleep, Loop } kind;
+    // flow id, sleep ns or loop count
+    int64_t arg;
+    // Loop only: the body is steps (this, bodyEnd)
+    int32_t bodyEnd = 0;
+  };
+
+  std::vector<Hardware> hardware;
+  std::vector<Operator> operators;
+  std::vector<Flow> flows;
+  std::vector<SimuStep> simu;
+
+  int32_t FindFlow(const std::string &name) const;
+  int32_t FindOperator(const std::string &name) const;
+  // fills Node::rank and Flow::criticalPath, callees first
+  void RankFlow(int32_t flow);
+
+private:
+  // one flow whose callees are all ranked
+  void RankNodes(int32_t flow);
+};
+
+/*
+  Order in which ready instances of one hardware are handed to idle devices.
+  Devices of a hardware are identical and an operator is bound to its
+  hardware, so list scheduling only has to pick the instance.
+
+    Fifo          the order instances became ready
+    CriticalPath  highest upward rank first (HEFT without the processor
+                  choice): the instance on the longest remaining path to the
+                  end of its flow call goes first
+*/
+enum class SIMSchedulerPolicy { Fifo, CriticalPath };
+
+SIMSchedulerPolicy ParseSchedulerPolicy(const std::string &name);
+
+/*
+  What LowerTaskGraph keeps of a user flow block it is told not to lower,
+  e.g. because its code comes from SIMFlowCache. The flow and its foreach
+  bodies get no nodes, so such a graph can only be used to emit code.
+*/
+struct SIMFlowBlockStub {
+  uint64_t criticalPath = 0;
+  // in the order lowering would have created them
+  std::vector<std::string> foreachNames;
+};
+
+// flow blocks are lowered on `jobs` threads, 0: one per core; blocks named
+// in `stubs` are not lowered at all
+SIMTaskGraph LowerTaskGraph(
+    SIMTranslationUnit *unit, int32_t jobs = 1,
+    const std::map<std::string, SIMFlowBlockStub> *stubs = nullptr);
+
+// threads SIMParallelFor runs `cnt` items on, never more than cnt
+int32_t SIMJobCnt(int32_t jobs, int32_t cnt);
+
+/*
+  Calls body(index, worker) for every index in [0, cnt), worker being in
+  [0, SIMJobCnt(jobs, cnt)). Indices are handed out in increasing order; once
+  a body throws no new index starts, and the exception of the lowest failing
+  index is rethrown, which is the one a serial loop would have stopped at.
+*/
+void SIMParallelFor(int32_t cnt, int32_t jobs,
+                    const std::function<void(int32_t, int32_t)> &body);
+
+/*
+  Log-linear histogram in the style of HdrHistogram: values below 32 get a
+  bucket each, and every power of two above that is split into 32 buckets,
+  so a quantile is within 1/32 of a recorded value. Recording is an index
+  computation and an increment; histograms of different threads are merged
+  by adding buckets. The emitted simulators carry the same type.
+*/
+struct SIMHistogram {
+  static constexpr int32_t kSubBits = 5;
+  static constexpr int32_t kBucketCnt = (64 - kSubBits + 1) << kSubBits;
+  // allocated on the first Record
+  std::vector<uint64_t> buckets;
+  uint64_t count = 0, max = 0;
+
+  void Record(uint64_t value);
+  void Merge(const SIMHistogram &other);
+  // the highest value equivalent to the one at quantile q, 0 when empty
+  uint64_t Quantile(double q) const;
+};
+
+// one executed instance, times in ns
+struct SIMTraceEvent {
+  // 1-based, as the emitted simulators number instances
+  uint64_t id;
+  int32_t op;
+  // the flow simu called when the instance was registered
+  int32_t flow;
+  int32_t hardware, device;
+  uint64_t readyTime, beginTime, endTime;
+};
+
+struct SIMEngineResult {
+  // virtual time in ns
+  uint64_t makespan = 0;
+  uint64_t instanceCnt = 0;
+  // [hardware][device], ns
+  std::vector<std::vector<uint64_t>> busyTime;
+  // in dispatch order, only when SIMEngine::trace is set
+  std::vector<SIMTraceEvent> trace;
+  // only when SIMEngine::metrics is set, ns: from the time simu called a
+  // flow to the end of its last instance, by flow id
+  std::vector<SIMHistogram> flowLatency;
+  // by hardware, ns from ready to start, and the ready instances left
+  // waiting whenever one starts
+  std::vector<SIMHistogram> hardwareWait, hardwareDepth;
+
+  std::string dump(const SIMTaskGraph &graph) const;
+  // Chrome trace JSON, also read by Perfetto: a process per hardware, a
+  // thread per device and a complete event per instance
+  void WriteChromeTrace(const SIMTaskGraph &graph, std::ostream &os) const;
+  // latency and ready queue tables, printed after dump
+  std::string MetricsReport(const SIMTaskGraph &graph) const;
+  void WriteMetricsJSON(const SIMTaskGraph &graph, std::ostream &os) const;
+};
+
+/*
+  In-process discrete-event engine. Runs simu on a virtual clock, registering
+  instances into dense arrays, then executes them with the same event order as
+  the code emitted by SIMIRBuilder::AST2DESIR.
+*/
+struct SIMEngine {
+  const SIMTaskGraph &graph;
+  SIMSchedulerPolicy policy = SIMSchedulerPolicy::Fifo;
+  // record a SIMTraceEvent per instance into the result
+  bool trace = false;
+  // fill the latency and ready queue histograms of the result
+  bool metrics = false;
+
+  explicit SIMEngine(const SIMTaskGraph &graph) : graph(graph) {}
+  SIMEngineResult Run();
+
+  /*
+    Driver interface for backends that run simu themselves, such as the LLVM
+    JIT: Reset, then Sleep / RegisterInstanceRanges in simu order, then
+    Finish. BeginFlow before each flow simu calls attributes the instances
+    for a trace and starts the call whose latency the metrics measure.
+    Instance ids are dense, so the ids registered by one flow call always
+    form the range [InstanceCnt() before, InstanceCnt() after).
+    `rank` is the node rank plus the tail rank the flow was called with.
+  */
+  void Reset();
+  void Sleep(int64_t ns) { virtualNow += ns; }
+  void BeginFlow(int32_t flow);
+  uint64_t InstanceCnt() const { return instanceOp.size(); }
+  // predecessors are the ids in [preRanges[2k], preRanges[2k + 1])
+  uint64_t RegisterInstanceRanges(int32_t op, const uint64_t *preRanges,
+                                  uint64_t rangeCnt, uint64_t rank);
+  SIMEngineResult Finish();
+
+private:
+  uint64_t virtualNow = 0;
+  int32_t simuFlow = -1;
+  std::vector<int32_t> instanceOp;
+  // trace only
+  std::vector<int32_t> instanceFlow;
+  // metrics only: flow and issue time of every flow simu called, and the
+  // call each instance was registered by
+  std::vector<int32_t> invocationFlow;
+  std::vector<uint64_t> invocationTime;
+  std::vector<uint64_t> instanceInvocation;
+  std::vector<uint64_t> instanceReleaseTime;
+  std::vector<uint64_t> instanceRank;
+  // CSR: predecessors of instance i are preIds[preOffset[i], preOffset[i + 1])
+  std::vector<uint64_t> preOffset;
+  std::vector<uint64_t> preIds;
+
+  uint64_t RegisterInstance(int32_t op, const std::vector<uint64_t> &pre,
+                            uint64_t rank);
+  void Instantiate(int32_t flow, const std::vector<uint64_t> &pre,
+                   uint64_t tailRank, std::vector<uint64_t> &out);
+  void RunSimu(int32_t begin, int32_t end);
+  void RunEvents(SIMEngineResult &result);
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __SIM_FLOW_CACHE_H_
+#define __SIM_FLOW_CACHE_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "SimAST.h"
+#include "SimEngine.h"
+
+namespace XPUSchedulerSimulator {
+
+// C++ one user flow block emits: its own function and its foreach bodies
+struct SIMFlowCacheEntry {
+  SIMFlowBlockStub stub;
+  std::string text;
+};
+
+/*
+  On-disk cache of the C++ emitted per user flow block, one file per entry
+  in `dir`. A block's key hashes everything its text depends on: the
+  block's AST, the time of every operator it names and the keys of the
+  flows it calls, so changing hardware counts invalidates nothing and
+  changing one flow only invalidates it and the flows that call it.
+*/
+struct SIMFlowCache {
+  std::string dir;
+  // flow name -> key
+  std::map<std::string, uint64_t> keys;
+
+  // false when the flows cannot be keyed, e.g. a flow calls itself; the
+  // lowering then reports the error
+  bool ComputeKeys(SIMTranslationUnit *unit);
+  bool Load(uint64_t key, SIMFlowCacheEntry &entry) const;
+  // written to a temporary file and renamed, concurrent compilers may share
+  // a directory
+  void Store(uint64_t key, const SIMFlowCacheEntry &entry) const;
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef __SIM_PRE_PROCESSOR_H_
+#define __SIM_PRE_PROCESSOR_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "SimSource.h"
+
+namespace XPUSchedulerSimulator {
+
+// one #define; a function-like macro has parentheses, maybe no params
+struct SIMMacro {
+  bool functionLike = false;
+  std::vector<std::string> params;
+  std::string body;
+};
+
+/*
+  A file as the preprocessor keeps it: its text with comments stripped and
+  lines spliced, and its directive lines cut out and parsed. Everything
+  that depends on the macros defined at the time, like expansion and
+  conditions, is left to the walk, so a file is scanned once no matter how
+  often it is included.
+*/
+struct SIMPreFile {
+  enum Kind : uint8_t {
+    Include,
+    Define,
+    Undef,
+    If,
+    Ifdef,
+    Ifndef,
+    Elif,
+    Else,
+    Endif,
+    Error,
+    Warning,
+    Pragma
+  };
+  struct Directive {
+    Kind kind;
+    int32_t lineno;
+    // offset in text the line was cut out at
+    size_t pos;
+    std::string args;
+    // #define, #undef, #ifdef and #ifndef
+    std::string name;
+    SIMMacro macro;
+    // a malformed directive only fails when it is not skipped
+    std::string error;
+  };
+
+  const SIMSource *source = nullptr;
+  // set for included files, the main file belongs to the caller
+  std::unique_ptr<SIMSource> ownedSource;
+  // source->Text() itself when nothing was stripped, else stripped
+  std::string_view text;
+  std::string stripped;
+  std::vector<Directive> directives;
+  // newlines in text, line n of the file is line n of text
+  int32_t lineCnt = 0;
+  // #pragma once
+  bool once = false;
+  // the macro of an #ifndef / #define / #endif around the whole file
+  std::string guard;
+};
+
+/*
+  C-style preprocessor in front of the .arc lexer. A file is read in one
+  forward pass that strips // and block comments, splices
+  backslash-newlines and parses directive lines into a SIMPreFile. A run
+  then walks the main file, evaluating conditions and expanding macros;
+  text is copied to the output as whole spans, and a main file that needs
+  no change is not copied at all. Every line keeps its line number within
+  its file, so the parser maps diagnostics back with Output().Locate().
+
+  Included files and the resolution of every #include are kept across
+  runs. A header shared by a batch of inputs is read and scanned once, and
+  inside one run a file with #pragma once or an include guard is walked
+  once.
+
+  Directives: #include "file" / <file>, #define (object-like and
+  function-like, with ##), #undef, #if, #elif, #ifdef, #ifndef, #else,
+  #endif, #error, #warning and #pragma once. Any other line starting with
+  `#` is an .arc comment and is left to the lexer.
+*/
+class SIMPreProcessor {
+public:
+  // searched for #include <file>, and for #include "file" after the
+  // directory of the including file
+  std::vector<std::string> includeDirs;
+
+  // throws std::logic_error, "<file>:<line>: <message>"; source must
+  // outlive Output()
+  void Run(const SIMSource &source);
+  // the preprocessed text, valid until the next Run
+  const SIMSource &Output() const { return *result; }
+
+private:
+  // one open #if, #ifdef or #ifndef
+  struct Conditional {
+    // lines of the current group are kept
+    bool active;
+    // some group of this conditional was kept
+    bool taken;
+    bool seenElse;
+    bool parentActive;
+    int32_t lineno;
+  };
+  using MacroMap = std::map<std::string, SIMMacro, std::less<>>;
+
+  bool Active() const {
+    return conditionals.empty() || conditionals.back().active;
+  }
+  std::unique_ptr<SIMPreFile> Scan(const SIMSource &source) const;
+  void Walk(const SIMPreFile &file, int32_t depth);
+  const SIMPreFile *Resolve(const SIMPreFile &file,
+                            const SIMPreFile::Directive &include);
+  // appends text with its macros expanded, lineno is where text starts
+  void Expand(std::string_view text, std::string &dst,
+              std::vector<const std::string *> &expanding,
+              const SIMSource &file, int32_t lineno);
+  std::string Substitute(MacroMap::const_iterator macro,
+                         const std::vector<std::string> &args,
+                         std::vector<const std::string *> &expanding,
+                         const SIMSource &file, int32_t lineno);
+  bool Evaluate(const SIMSource &file, const SIMPreFile::Directive &cond);
+  [[noreturn]] static void Error(const SIMSource &file, int32_t lineno,
+                                 const std::string &message);
+
+  MacroMap macros;
+  // set by Expand when its text ends in the name of a function-like macro
+  // that is not followed by (, so the caller can pass it the arguments that
+  // follow in its own text; trailingPos is where the name was written
+  MacroMap::const_iterator trailing;
+  size_t trailingPos = 0;
+  std::vector<Conditional> conditionals;
+  // every file included so far, by canonical path
+  std::map<std::string, std::unique_ptr<SIMPreFile>> files;
+  // directory of the includer for "file", then the name as written -> file
+  std::map<std::string, const SIMPreFile *> includeGraph;
+  // includeDirs includeGraph was resolved with
+  std::vector<std::string> graphIncludeDirs;
+  // walked in this run, for #pragma once
+  std::set<const SIMPreFile *> walked;
+  std::string out;
+  // newlines written to out
+  int32_t outLines = 0;
+  std::unique_ptr<SIMSource> output;
+  // output, or the source itself when it needed no change
+  const SIMSource *result = nullptr;
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
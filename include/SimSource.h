@@ -0,0 +1,73 @@
+#ifndef __SIM_SOURCE_H_
+#define __SIM_SOURCE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace XPUSchedulerSimulator {
+
+/*
+  Text of one .arc input. Files are mapped read-only instead of read, and
+  the scanner pulls from the mapping through its own small buffer, so an
+  input of any size is never copied as a whole. Line offsets are indexed
+  on the first diagnostic, once even when parses of the same source fail
+  on several threads, and every later lookup is O(1).
+*/
+class SIMSource {
+public:
+  SIMSource() = default;
+  // the text is not copied and must outlive the source
+  explicit SIMSource(std::string_view text) : text(text) {}
+  SIMSource(const SIMSource &) = delete;
+  SIMSource &operator=(const SIMSource &) = delete;
+  ~SIMSource();
+
+  // false, with errno set, when path cannot be read; pipes and other
+  // files that cannot be mapped are read into memory instead
+  bool Map(const std::string &path);
+  // takes text over, e.g. the output of the preprocessor; only for a
+  // source that has no text yet
+  void Assign(std::string text);
+
+  std::string_view Text() const { return text; }
+  // the file the text was read from, empty for text in memory
+  const std::string &Path() const { return path; }
+  // lines lineno - 1 .. lineno + 1 (1-based, as yylineno counts them)
+  std::string Excerpt(int32_t lineno) const;
+
+  // line `lineno` of `source`; text built from other sources maps its
+  // lines back with MapLines
+  struct Origin {
+    const SIMSource *source;
+    int32_t lineno;
+  };
+  Origin Locate(int32_t lineno) const;
+  // lines from lineno on continue line sourceLineno of source; calls come
+  // in increasing lineno, a later call for the same lineno wins
+  void MapLines(int32_t lineno, const SIMSource *source, int32_t sourceLineno);
+
+private:
+  std::string_view text;
+  std::string path;
+  void *mapping = nullptr;
+  size_t mappingSize = 0;
+  std::string storage;
+  // offset of the first character of every line, filled once under
+  // lineIndexOnce
+  mutable std::once_flag lineIndexOnce;
+  mutable std::vector<size_t> lineBegin;
+  // first line of each run that was copied from one source, by lineno
+  struct LineRun {
+    int32_t lineno;
+    Origin origin;
+  };
+  std::vector<LineRun> lineRuns;
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef __SIM_SWEEP_H_
+#define __SIM_SWEEP_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "SimEngine.h"
+
+namespace XPUSchedulerSimulator {
+
+// one swept parameter: the device count of a hardware or the time of an
+// operator
+struct SIMSweepAxis {
+  std::string name;
+  bool hardware;
+  // into graph.hardware or graph.operators
+  int32_t index;
+  // device counts, or operator times in ns
+  std::vector<int64_t> values;
+};
+
+/*
+  "NAME=V,V,..." or "NAME=LO..HI[:STEP]". NAME is a hardware, whose values
+  are device counts (STEP defaults to 1), or an operator, whose values are
+  durations as the .arc file writes them (2us, 1.5ms, a plain number of
+  ms) and whose ranges need a STEP. Throws std::logic_error.
+*/
+SIMSweepAxis ParseSweepAxis(const SIMTaskGraph &graph,
+                            const std::string &spec);
+
+// one point of the sweep, the cartesian product of every axis
+struct SIMSweepVariant {
+  // one per axis
+  std::vector<int64_t> values;
+  // devices of every hardware in this variant
+  std::vector<int32_t> hardwareCnt;
+  SIMEngineResult result;
+};
+
+/*
+  Simulates one lowered program against every combination of the axes.
+  The program is parsed and lowered once; each worker keeps one copy of
+  the task graph, sets the counts and times of the variant in it and runs
+  SIMEngine, so variants run side by side on `jobs` threads. Results come
+  back in variant order: the last axis varies fastest.
+*/
+struct SIMSweep {
+  const SIMTaskGraph &graph;
+  std::vector<SIMSweepAxis> axes;
+  SIMSchedulerPolicy policy = SIMSchedulerPolicy::Fifo;
+  // 0: one per core
+  int32_t jobs = 0;
+
+  explicit SIMSweep(const SIMTaskGraph &graph) : graph(graph) {}
+  std::vector<SIMSweepVariant> Run() const;
+
+  // a row per variant and device: the axis values, makespan in seconds,
+  // and the busy time and usage of the device
+  void WriteCSV(const std::vector<SIMSweepVariant> &variants,
+                std::ostream &os) const;
+  void WriteJSON(const std::vector<SIMSweepVariant> &variants,
+                 std::ostream &os) const;
+};
+
+} // namespace XPUSchedulerSimulator
+
+#endif
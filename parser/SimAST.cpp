@@ -1,13 +1,74 @@
 #include "SimAST.h"
 
-#include <cstring>
+#include <algorithm>
 
-#include "sim_lexer.h"
 #include "sim_parser.h"
+#include "sim_lexer.h"
 
 namespace XPUSchedulerSimulator {
 
-const char *src = nullptr;
+void *SIMArena::Allocate(size_t size, size_t align) {
+  size_t padding = -reinterpret_cast<uintptr_t>(cur) & (align - 1);
+  if (cur == nullptr || padding + size > static_cast<size_t>(end - cur)) {
+    // oversized requests get a chunk of their own
+    size_t chunkSize = std::max(kChunkSize, size + align);
+    chunks.emplace_back(new char[chunkSize]);
+    cur = chunks.back().get();
+    end = cur + chunkSize;
+    padding = -reinterpret_cast<uintptr_t>(cur) & (align - 1);
+  }
+  void *ret = cur + padding;
+  cur += padding + size;
+  return ret;
+}
+
+SIMSymbol *SIMSymbolTable::Intern(std::string_view name) {
+  auto it = index.find(name);
+  if (it != index.end()) {
+    return it->second;
+  }
+  SIMSymbol &symbol = symbols.emplace_back();
+  symbol.name = std::string(name);
+  symbol.id = symbols.size() - 1;
+  index.emplace(symbol.name, &symbol);
+  return &symbol;
+}
+
+int64_t SIMParseDuration(std::string_view text) {
+  static const std::pair<std::string_view, int64_t> units[] = {
+      {"ns", 1}, {"us", 1000}, {"ms", 1000000}, {"s", 1000000000}};
+  int64_t unit = 1000000;
+  for (const auto &[suffix, ns] : units) {
+    if (text.size() > suffix.size() &&
+        text.substr(text.size() - suffix.size()) == suffix) {
+      text.remove_suffix(suffix.size());
+      unit = ns;
+      break;
+    }
+  }
+
+  // whole units, then the fraction as exact digits, never a double
+  size_t dot = std::min(text.find('.'), text.size());
+  int64_t ns = 0, limit = INT64_MAX / unit;
+  for (char c : text.substr(0, dot)) {
+    if (ns > (limit - (c - '0')) / 10) {
+      return -1;
+    }
+    ns = ns * 10 + (c - '0');
+  }
+  ns *= unit;
+  // unit <= 1e9, so 9 digits of fraction times unit stay below 1e18
+  int64_t fraction = 0, scale = 1;
+  for (char c : text.substr(std::min(dot + 1, text.size()))) {
+    if (scale == 1000000000) {
+      break;
+    }
+    fraction = fraction * 10 + (c - '0');
+    scale *= 10;
+  }
+  int64_t rest = (fraction * unit + scale / 2) / scale;
+  return ns > INT64_MAX - rest ? -1 : ns + rest;
+}
 
 std::string SimASTDumpIndent(int32_t indent) {
   std::string str;
@@ -17,34 +78,46 @@ std::string SimASTDumpIndent(int32_t indent) {
   return str;
 }
 
-SIMTranslationUnit *GenSimAST(const char *srcPtr) {
-  src = srcPtr;
-  yy_scan_bytes(srcPtr, strlen(srcPtr));
-  SIMTranslationUnit *unit = nullptr;
-  int status = yyparse(&unit);
+SIMTranslationUnit *GenSimAST(const SIMSource &source) {
+  SIMParseContext ctx;
+  ctx.unit = new SIMTranslationUnit;
+  ctx.source = &source;
+  yyscan_t scanner;
+  if (yylex_init_extra(&ctx, &scanner) != 0) {
+    delete ctx.unit;
+    return nullptr;
+  }
+  int status = yyparse(scanner, &ctx);
+  yylex_destroy(scanner);
   if (status == 0) {
-    return unit;
+    return ctx.unit;
   } else {
+    delete ctx.unit;
     return nullptr;
   }
 }
 
-std::string GetSrc(int32_t lineno) {
-  std::string ret;
-  lineno = std::max(lineno - 2, 0);
-  int32_t currentLine = 0;
-  for (const char *p = src; *p != 0; p++) {
-    if (currentLine >= lineno && currentLine <= lineno + 2) {
-      ret += *p;
-    } else if (currentLine >= lineno + 2) {
-      break;
-    }
-    if (*p == '\n') {
-      currentLine++;
-    }
+int64_t SIMLexTokens(const SIMSource &source) {
+  SIMTranslationUnit unit;
+  SIMParseContext ctx;
+  ctx.unit = &unit;
+  ctx.source = &source;
+  yyscan_t scanner;
+  if (yylex_init_extra(&ctx, &scanner) != 0) {
+    return -1;
+  }
+  YYSTYPE value;
+  int64_t cnt = 0;
+  while (yylex(&value, scanner) != 0) {
+    cnt++;
   }
+  yylex_destroy(scanner);
+  return cnt;
+}
 
-  return ret;
+SIMTranslationUnit *GenSimAST(const char *srcPtr) {
+  SIMSource source{std::string_view(srcPtr)};
+  return GenSimAST(source);
 }
 
 } // namespace XPUSchedulerSimulator
\ No newline at end of file
@@ -1,659 +1,1881 @@
 #include "SimAST2IR.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <set>
+#include <sstream>
 #include <stdexcept>
 
 namespace XPUSchedulerSimulator {
 
-void SIMIRBuilder::AST2CPPIR(SIMTranslationUnit *unit) {
-  ir += EmitMainFunc(unit);
+void SIMIRWriter::Open(std::ostream &os) {
+  sink = &os;
+  buf.resize(1 << 16);
+  used = 0;
 }
 
-std::string SIMIRBuilder::EmitIRHeader() {
-  return R"(
-        #include <sys/time.h>
-        #include <unistd.h>
+void SIMIRWriter::Write(const char *data, size_t size) {
+  if (used + size > buf.size()) {
+    Flush();
+    if (size > buf.size()) {
+      sink->write(data, size);
+      return;
+    }
+  }
+  std::memcpy(buf.data() + used, data, size);
+  used += size;
+}
+
+void SIMIRWriter::Flush() {
+  sink->write(buf.data(), used);
+  used = 0;
+}
+
+SIMIRWriter &SIMIRWriter::operator<<(const char *str) {
+  Write(str, std::strlen(str));
+  return *this;
+}
+
+SIMIRWriter &SIMIRWriter::operator<<(const std::string &str) {
+  Write(str.data(), str.size());
+  return *this;
+}
 
+/*
+  The emitted flows walk the same lowered graph as --mode=run, so instance
+  ids and --scheduler=cp ranks agree across every backend. Blocks whose
+  text is cached are only stubbed in the graph.
+*/
+void SIMIRBuilder::LowerFlows(SIMTranslationUnit *unit) {
+  cache.dir = cacheDir;
+  cachedText.clear();
+  if (cacheDir.empty() || !cache.ComputeKeys(unit)) {
+    cache.keys.clear();
+    graph = LowerTaskGraph(unit, jobs);
+    return;
+  }
+  std::vector<std::pair<std::string, uint64_t>> keys(cache.keys.begin(),
+                                                     cache.keys.end());
+  std::vector<SIMFlowCacheEntry> entries(keys.size());
+  std::vector<char> hit(keys.size());
+  SIMParallelFor(keys.size(), jobs, [&](int32_t i, int32_t) {
+    hit[i] = cache.Load(keys[i].second, entries[i]);
+  });
+  std::map<std::string, SIMFlowBlockStub> stubs;
+  for (int32_t i = 0; i < keys.size(); i++) {
+    if (hit[i]) {
+      stubs[keys[i].first] = std::move(entries[i].stub);
+      cachedText[keys[i].first] = std::move(entries[i].text);
+    }
+  }
+  graph = LowerTaskGraph(unit, jobs, &stubs);
+}
+
+void SIMIRBuilder::AST2CPPIR(SIMTranslationUnit *unit, std::ostream &os) {
+  LowerFlows(unit);
+  out.Open(os);
+  EmitIRHeader();
+  EmitClockFunc();
+  EmitHardwareEnum(unit);
+  EmitHardwareCntMap(unit);
+  EmitOperatorFuncBody(unit);
+  EmitOpToTimeMap(unit);
+  if (!tracePath.empty()) {
+    EmitTraceFunc(unit);
+  }
+  if (metrics) {
+    EmitMetricsFunc(unit);
+  }
+  EmitLockFreeQueueClass(unit);
+  EmitInstanceSlotTable(unit);
+  EmitTheoreticalTimeArray(unit);
+  EmitBackpressure(unit);
+  EmitRegisterInstanceFunc(unit);
+  EmitFlowFunc(unit);
+  EmitSimuFunc(unit);
+  EmitScheduler(unit);
+  if (devicePool) {
+    EmitDevicePoolFunc(unit);
+  } else {
+    EmitHardwareExecuteFunc(unit);
+  }
+  EmitInstanceExecuteService(unit);
+  EmitMainFunc(unit);
+  out.Flush();
+}
+
+void SIMIRBuilder::AST2DESIR(SIMTranslationUnit *unit, std::ostream &os) {
+  LowerFlows(unit);
+  out.Open(os);
+  EmitIRHeader();
+  EmitHardwareEnum(unit);
+  EmitHardwareCntMap(unit);
+  EmitOpToTimeMap(unit);
+  if (!tracePath.empty()) {
+    EmitTraceFunc(unit);
+  }
+  if (metrics) {
+    EmitMetricsFunc(unit);
+  }
+  EmitInstanceMap(unit);
+  EmitTheoreticalTimeArray(unit);
+  EmitVirtualRegisterInstanceFunc(unit);
+  EmitFlowFunc(unit);
+  EmitVirtualSimuFunc(unit);
+  EmitDiscreteEventScheduler(unit);
+  EmitDiscreteEventMainFunc(unit);
+  out.Flush();
+}
+
+void SIMIRBuilder::EmitIRHeader() {
+  out << R"(
+        #include <time.h>
+
+        #include <algorithm>
         #include <atomic>
+        #include <cerrno>
+        #include <chrono>
+        #include <cmath>
+        #include <condition_variable>
         #include <cstdint>
+        #include <cstdio>
+        #include <functional>
         #include <iostream>
+        #include <iterator>
         #include <map>
+        #include <memory>
         #include <mutex>
         #include <queue>
         #include <set>
         #include <thread>
+        #include <tuple>
         #include <unordered_map>
         #include <vector>
     )";
 }
 
-std::string SIMIRBuilder::EmitHardwareEnum(SIMTranslationUnit *unit) {
-  std::string ret = R"(
+/*
+  Wall-clock time base, nanoseconds of steady_clock. Waits sleep with an
+  absolute clock_nanosleep until shortly before the deadline and spin the
+  rest; the margin is what the host's sleep overshoots by, measured once at
+  startup, so operators of a few microseconds end on time and long ones do
+  not hold a core.
+*/
+void SIMIRBuilder::EmitClockFunc() {
+  out << R"(
+        // steady_clock is CLOCK_MONOTONIC on Linux, its readings are deadlines
+        // clock_nanosleep can wait for directly
+        inline int64_t NowNs() {
+          return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+              .count();
+        }
+
+        void SleepUntil(int64_t deadline) {
+          struct timespec ts;
+          ts.tv_sec = deadline / 1000000000;
+          ts.tv_nsec = deadline % 1000000000;
+          while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+          }
+        }
+
+        // how late a wakeup may come, waits shorter than this only spin
+        int64_t sleepSlackNs;
+
+        void CalibrateSleep() {
+          int64_t worst = 0;
+          for (int32_t i = 0; i < 20; i++) {
+            int64_t deadline = NowNs() + 100000;
+            SleepUntil(deadline);
+            worst = std::max(worst, NowNs() - deadline);
+          }
+          sleepSlackNs = worst + worst / 2 + 10000;
+        }
+
+        void WaitUntil(int64_t deadline) {
+          if (deadline - sleepSlackNs > NowNs()) {
+            SleepUntil(deadline - sleepSlackNs);
+          }
+          while (NowNs() < deadline) {
+          }
+        }
+  )";
+}
+
+void SIMIRBuilder::EmitHardwareEnum(SIMTranslationUnit *unit) {
+  out << R"(
         enum class Hardware
         {
     )";
   for (auto *hardwareExpr : unit->hardware->exprs) {
-    ret += "\t\t";
-    ret += hardwareExpr->hardwareName->name;
-    ret += ",";
-    ret += "\n";
+    out << "\t\t";
+    out << hardwareExpr->hardwareName->name;
+    out << ",";
+    out << "\n";
+  }
+  out << "\t};\n";
+  out << "\tconst char *const hardwareName[] = {";
+  for (auto *hardwareExpr : unit->hardware->exprs) {
+    out.Format("\"%s\", ", hardwareExpr->hardwareName->name.c_str());
   }
-  ret += "\t};\n\n";
-  return ret;
+  out << "};\n\n";
 }
 
-std::string SIMIRBuilder::EmitHardwareCntMap(SIMTranslationUnit *unit) {
-  std::string ret = "\tstd::map<Hardware, int32_t> hardwareCnt{";
+void SIMIRBuilder::EmitHardwareCntMap(SIMTranslationUnit *unit) {
+  out << "\tstd::map<Hardware, int32_t> hardwareCnt{";
   for (auto *hardwareExpr : unit->hardware->exprs) {
-    ret += "{Hardware::";
-    ret += hardwareExpr->hardwareName->name;
-    ret += ", ";
-    ret += std::to_string(hardwareExpr->hardwareCnt);
-    ret += "}, ";
-  }
-  ret += "};\n";
-  return ret;
-}
-
-std::string SIMIRBuilder::EmitOperatorFuncBody(SIMTranslationUnit *unit) {
-  std::string ret;
-  ret += R"(
-        #define FUNC_BODY(_NAME, _TIME)                                     \
-        void _NAME() {                                                      \
-          struct timeval begin, now;                                        \
-          gettimeofday(&begin, NULL);                                       \
-          while (true) {                                                    \
-            gettimeofday(&now, NULL);                                       \
-            if (now.tv_sec * 1000000ULL + now.tv_usec >                     \
-                begin.tv_sec * 1000000ULL + begin.tv_usec + _TIME * 1000) { \
-              return;                                                       \
-            }                                                               \
-            usleep(10);                                                     \
-          }                                                                 \
-        }
+    out << "{Hardware::";
+    out << hardwareExpr->hardwareName->name;
+    out << ", ";
+    out << std::to_string(hardwareExpr->hardwareCnt);
+    out << "}, ";
+  }
+  out << "};\n";
+}
+
+void SIMIRBuilder::EmitOperatorFuncBody(SIMTranslationUnit *unit) {
+  out << R"(
+        #define FUNC_BODY(_NAME, _TIME_NS)                                  \
+        void _NAME() { WaitUntil(NowNs() + _TIME_NS); }
 
   )";
   for (auto *operatorExpr : unit->op->exprs) {
-    ret += StringFormat("\tFUNC_BODY(%s, %d)\n",
-                        operatorExpr->opName->name.c_str(), operatorExpr->time);
+    out.Format("\tFUNC_BODY(%s, %" PRId64 ")\n",
+               operatorExpr->opName->name.c_str(), operatorExpr->time);
+  }
+  out << "\n\tvoid (*const operatorFunc[])() = {";
+  for (auto *operatorExpr : unit->op->exprs) {
+    out << operatorExpr->opName->name << ", ";
   }
-  return ret;
+  out << "};\n";
 }
 
-std::map<std::string, int32_t> g_OperatorTime;
-
-std::string SIMIRBuilder::EmitOpToTimeMap(SIMTranslationUnit *unit) {
-  std::string ret =
-      R"(
-        std::map<void *, std::pair<Hardware, int32_t>> operatorToHardwareTime{
-  )";
+/*
+  Operators get dense ids in declaration order, `Operator::<name>`; the
+  hardware and cost of an instance are plain array lookups by that id.
+*/
+void SIMIRBuilder::EmitOpToTimeMap(SIMTranslationUnit *unit) {
+  out << "\n\tenum class Operator : int32_t {\n";
   for (auto *operatorExpr : unit->op->exprs) {
-    ret += StringFormat("\t\t{(void *)%s, {Hardware::%s, %d}},\n",
-                        operatorExpr->opName->name.c_str(),
-                        operatorExpr->hardwareName->name.c_str(),
-                        operatorExpr->time);
-    g_OperatorTime[operatorExpr->opName->name] = operatorExpr->time;
-  }
-  ret += "\t};\n\n";
-  return ret;
-}
-std::string SIMIRBuilder::EmitInstanceMap(SIMTranslationUnit *unit) {
-  std::string ret = R"(
-        std::map<uint64_t, bool> aliveInstanceId;
-        std::map<uint64_t, std::vector<uint64_t>> instancePreId, instancePostId;
-        std::map<uint64_t, void *> instanceToOperator;
-        uint64_t topInstanceId;
-        volatile uint64_t simuDone;
-        volatile uint64_t schedulerDone;
-  )";
-  return ret;
+    out.Format("\t\t%s,\n", operatorExpr->opName->name.c_str());
+  }
+  out << "\t};\n";
+  out << "\tconstexpr Hardware operatorHardware[] = {";
+  for (auto *operatorExpr : unit->op->exprs) {
+    out.Format("Hardware::%s, ",
+               operatorExpr->hardwareName->name.c_str());
+  }
+  out << "};\n";
+  out << "\tconstexpr int64_t operatorTime[] = {";
+  for (auto *operatorExpr : unit->op->exprs) {
+    out.Format("%" PRId64 ", ", operatorExpr->time);
+  }
+  out << "};\n\n";
 }
-std::string SIMIRBuilder::EmitRegisterInstanceFunc(SIMTranslationUnit *unit) {
-  std::string ret = R"(
-        uint64_t registerInstance(void *op, const std::vector<uint64_t> &_instancePreId)
-        {
-            while (true) {
-              aliveInstanceMutex.lock();
-              if (aliveInstanceId.size() > 1023) {
-                aliveInstanceMutex.unlock();
-                usleep(10);
-                continue;
-              }
-              aliveInstanceId[++topInstanceId] = 0;
-              instancePreId[topInstanceId] = _instancePreId;
-              instanceToOperator[topInstanceId] = op;
-              for (auto preId : _instancePreId)
-              {
-                  instancePostId[preId].emplace_back(topInstanceId);
+
+// text as a C string literal
+static std::string CStringLiteral(const std::string &text) {
+  std::string ret = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+    }
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+/*
+  Trace recording. Whichever thread runs an instance appends one event to
+  a buffer of its own, registered on its first event; chunks never move,
+  so recording is a few stores and no synchronization. At exit the
+  buffers are written as Chrome trace JSON, in the same format as
+  SIMEngineResult::WriteChromeTrace. Instances are attributed to the flow
+  simu called, traceFlow.
+*/
+void SIMIRBuilder::EmitTraceFunc(SIMTranslationUnit *unit) {
+  out.Format("\n\tconst char *const kTracePath = %s;\n",
+             CStringLiteral(tracePath).c_str());
+  out << "\tconst char *const operatorName[] = {";
+  for (auto *expr : unit->op->exprs) {
+    out.Format("\"%s\", ", expr->opName->name.c_str());
+  }
+  out << "};\n";
+  out << R"(
+        struct TraceEvent {
+          uint64_t id;
+          int32_t op;
+          const char *flow;
+          int32_t hardware, device;
+          int64_t readyTime, beginTime, endTime;
+        };
+
+        struct TraceBuffer {
+          static constexpr size_t kChunk = 4096;
+          std::vector<std::unique_ptr<TraceEvent[]>> chunks;
+          // events in the last chunk
+          size_t used = kChunk;
+          TraceEvent &Next() {
+            if (used == kChunk) {
+              chunks.emplace_back(new TraceEvent[kChunk]);
+              used = 0;
+            }
+            return chunks.back()[used++];
+          }
+        };
+
+        std::mutex traceMutex;
+        std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+        const char *traceFlow = "";
+        // times are written relative to this
+        int64_t traceEpoch;
+
+        TraceBuffer &LocalTraceBuffer() {
+          thread_local TraceBuffer *buffer = nullptr;
+          if (buffer == nullptr) {
+            std::lock_guard<std::mutex> lock(traceMutex);
+            traceBuffers.emplace_back(new TraceBuffer);
+            buffer = traceBuffers.back().get();
+          }
+          return *buffer;
+        }
+
+        // ns as microseconds, the unit of the format, without rounding
+        struct TraceMicros {
+          char text[32];
+          explicit TraceMicros(int64_t ns) {
+            snprintf(text, sizeof(text), "%lld.%03lld", (long long)(ns / 1000),
+                     (long long)(ns % 1000));
+          }
+        };
+
+        void WriteTrace() {
+          FILE *file = fopen(kTracePath, "w");
+          if (file == NULL) {
+            perror(kTracePath);
+            return;
+          }
+          fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+          const char *separator = "\n";
+          for (auto &[hardware, cnt] : hardwareCnt) {
+            int32_t pid = (int32_t)hardware + 1;
+            fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}",
+                    separator, pid, hardwareName[pid - 1]);
+            separator = ",\n";
+            for (int32_t device = 0; device < cnt; device++) {
+              fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                      "\"tid\":%d,\"args\":{\"name\":\"%s_%d\"}}",
+                      separator, pid, device + 1, hardwareName[pid - 1], device);
+            }
+          }
+          for (auto &buffer : traceBuffers) {
+            for (size_t chunk = 0; chunk < buffer->chunks.size(); chunk++) {
+              size_t cnt = chunk + 1 < buffer->chunks.size() ? TraceBuffer::kChunk
+                                                             : buffer->used;
+              for (size_t i = 0; i < cnt; i++) {
+                const TraceEvent &event = buffer->chunks[chunk][i];
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%s,\"dur\":%s,\"args\":{\"id\":%llu,"
+                        "\"flow\":\"%s\",\"ready\":%s,\"wait\":%s}}",
+                        separator, operatorName[event.op], event.hardware + 1,
+                        event.device + 1,
+                        TraceMicros(event.beginTime - traceEpoch).text,
+                        TraceMicros(event.endTime - event.beginTime).text,
+                        (unsigned long long)event.id, event.flow,
+                        TraceMicros(event.readyTime - traceEpoch).text,
+                        TraceMicros(event.beginTime - event.readyTime).text);
+                separator = ",\n";
               }
-              aliveInstanceMutex.unlock();
-              break;
             }
-            return topInstanceId;
+          }
+          fprintf(file, "\n]}\n");
+          fclose(file);
         }
   )";
-  return ret;
-}
-
-std::map<std::string, std::vector<std::string>>
-GetOperatorGraph(const std::string &flowBlockName, SIMFlowBlock *block);
-
-// key: foreachName, value: cppir
-std::map<std::string, std::string> g_ForeachExprIR;
-std::map<std::string, std::string> g_ForeachExprIRHeader;
-// key: foreachName, value: count
-std::map<std::string, int32_t> g_ForeachCnt;
-
-std::string GetFlowCallOrOperatorCall(const std::string &currentInstance) {
-  if (g_OperatorTime.count(currentInstance)) {
-    return StringFormat("\t    uint64_t id_%s = registerInstance((void *)%s, "
-                        "preid_%s);\n",
-                        currentInstance.c_str(), currentInstance.c_str(),
-                        currentInstance.c_str());
-  } else if (g_ForeachCnt.count(currentInstance)) {
-    std::string ret;
-    for (int loopI = 0; loopI < g_ForeachCnt.at(currentInstance); loopI++) {
-      ret += StringFormat("\t    auto id_%s_loop%d = %s(preid_%s);\n",
-                          currentInstance.c_str(), loopI,
-                          currentInstance.c_str(), currentInstance.c_str());
-    }
-    return ret;
+}
+
+/*
+  Latency and ready queue metrics, the same histograms and report as
+  SIMHistogram and SIMEngineResult::MetricsReport. Every thread records
+  into Metrics of its own; they are merged once all threads joined.
+  BeginInvocation starts a flow call of simu, whose latency ends with the
+  last of its instances.
+*/
+void SIMIRBuilder::EmitMetricsFunc(SIMTranslationUnit *unit) {
+  if (!metricsPath.empty()) {
+    out.Format("\n\tconst char *const kMetricsPath = %s;\n",
+               CStringLiteral(metricsPath).c_str());
+  }
+  out.Format("\tconstexpr int32_t kFlowCnt = %d;\n", (int32_t)graph.flows.size());
+  out << "\tconst char *const flowName[] = {";
+  for (auto &flow : graph.flows) {
+    out.Format("\"%s\", ", flow.name.c_str());
+  }
+  out << "};\n";
+  out << R"(
+        struct Histogram {
+          static constexpr int32_t kSubBits = 5;
+          static constexpr int32_t kBucketCnt = (64 - kSubBits + 1) << kSubBits;
+          // allocated on the first Record
+          std::unique_ptr<uint64_t[]> buckets;
+          uint64_t count = 0, max = 0;
+
+          void Record(uint64_t value) {
+            if (!buckets) {
+              buckets.reset(new uint64_t[kBucketCnt]());
+            }
+            int32_t index = value;
+            if (value >= (1 << kSubBits)) {
+              int32_t exponent = 63 - __builtin_clzll(value);
+              index = ((exponent - kSubBits + 1) << kSubBits) +
+                      (value >> (exponent - kSubBits)) - (1 << kSubBits);
+            }
+            buckets[index]++;
+            count++;
+            max = std::max(max, value);
+          }
+
+          void Merge(const Histogram &other) {
+            if (other.count == 0) {
+              return;
+            }
+            if (!buckets) {
+              buckets.reset(new uint64_t[kBucketCnt]());
+            }
+            for (int32_t index = 0; index < kBucketCnt; index++) {
+              buckets[index] += other.buckets[index];
+            }
+            count += other.count;
+            max = std::max(max, other.max);
+          }
+
+          uint64_t Quantile(double q) const {
+            if (count == 0) {
+              return 0;
+            }
+            uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count));
+            uint64_t seen = 0;
+            int32_t index = 0;
+            while ((seen += buckets[index]) < rank) {
+              index++;
+            }
+            if (index < (1 << kSubBits)) {
+              return index;
+            }
+            int32_t exponent = (index >> kSubBits) + kSubBits - 1;
+            uint64_t mantissa = (index & ((1 << kSubBits) - 1)) + (1 << kSubBits);
+            return std::min(((mantissa + 1) << (exponent - kSubBits)) - 1, max);
+          }
+        };
+
+        constexpr int32_t kHardwareCnt = std::size(hardwareName);
+        struct Metrics {
+          Histogram flowLatency[kFlowCnt];
+          Histogram hardwareWait[kHardwareCnt], hardwareDepth[kHardwareCnt];
+
+          void Merge(const Metrics &other) {
+            for (int32_t flow = 0; flow < kFlowCnt; flow++) {
+              flowLatency[flow].Merge(other.flowLatency[flow]);
+            }
+            for (int32_t hardware = 0; hardware < kHardwareCnt; hardware++) {
+              hardwareWait[hardware].Merge(other.hardwareWait[hardware]);
+              hardwareDepth[hardware].Merge(other.hardwareDepth[hardware]);
+            }
+          }
+        };
+
+        std::mutex metricsMutex;
+        std::vector<std::unique_ptr<Metrics>> threadMetrics;
+
+        Metrics &LocalMetrics() {
+          thread_local Metrics *metrics = nullptr;
+          if (metrics == nullptr) {
+            std::lock_guard<std::mutex> lock(metricsMutex);
+            threadMetrics.emplace_back(new Metrics);
+            metrics = threadMetrics.back().get();
+          }
+          return *metrics;
+        }
+  )";
+  if (metricsPath.empty()) {
+    out << R"(
+        void ReportMetrics() {
+          Metrics total;
+          for (auto &metrics : threadMetrics) {
+            total.Merge(*metrics);
+          }
+          printf("\nFLOW\t\tCALLS\t\tLATENCY_P50\tLATENCY_P99\tLATENCY_P999\tLATENCY_MAX\n\n");
+          for (int32_t flow = 0; flow < kFlowCnt; flow++) {
+            Histogram &latency = total.flowLatency[flow];
+            if (latency.count == 0) {
+              continue;
+            }
+            printf("%s\t\t%llu\t\t%.9lf\t%.9lf\t%.9lf\t%.9lf\n", flowName[flow],
+                   (unsigned long long)latency.count, latency.Quantile(0.5) / 1e9,
+                   latency.Quantile(0.99) / 1e9, latency.Quantile(0.999) / 1e9,
+                   latency.max / 1e9);
+          }
+          printf("\nHARDWARE\tWAIT_P50\tWAIT_P99\tWAIT_P999\tWAIT_MAX\t"
+                 "DEPTH_P50\tDEPTH_P99\tDEPTH_MAX\n\n");
+          for (int32_t hardware = 0; hardware < kHardwareCnt; hardware++) {
+            Histogram &wait = total.hardwareWait[hardware];
+            Histogram &depth = total.hardwareDepth[hardware];
+            printf("%s\t\t%.9lf\t%.9lf\t%.9lf\t%.9lf\t%llu\t\t%llu\t\t%llu\n",
+                   hardwareName[hardware], wait.Quantile(0.5) / 1e9,
+                   wait.Quantile(0.99) / 1e9, wait.Quantile(0.999) / 1e9,
+                   wait.max / 1e9, (unsigned long long)depth.Quantile(0.5),
+                   (unsigned long long)depth.Quantile(0.99),
+                   (unsigned long long)depth.max);
+          }
+        }
+    )";
   } else {
-    return StringFormat("\t    auto id_%s = %s(preid_%s);\n",
-                        currentInstance.c_str(), currentInstance.c_str(),
-                        currentInstance.c_str());
+    out << R"(
+        void PrintMetricsJSON(FILE *file, const Histogram &histogram) {
+          fprintf(file, "{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                  (unsigned long long)histogram.count,
+                  (unsigned long long)histogram.Quantile(0.5),
+                  (unsigned long long)histogram.Quantile(0.99),
+                  (unsigned long long)histogram.Quantile(0.999),
+                  (unsigned long long)histogram.max);
+        }
+
+        void ReportMetrics() {
+          Metrics total;
+          for (auto &metrics : threadMetrics) {
+            total.Merge(*metrics);
+          }
+          FILE *file = fopen(kMetricsPath, "w");
+          if (file == NULL) {
+            perror(kMetricsPath);
+            return;
+          }
+          fprintf(file, "{\"flows\":[");
+          const char *separator = "\n";
+          for (int32_t flow = 0; flow < kFlowCnt; flow++) {
+            if (total.flowLatency[flow].count == 0) {
+              continue;
+            }
+            fprintf(file, "%s{\"name\":\"%s\",\"latency\":", separator, flowName[flow]);
+            PrintMetricsJSON(file, total.flowLatency[flow]);
+            fprintf(file, "}");
+            separator = ",\n";
+          }
+          fprintf(file, "\n],\"hardware\":[");
+          separator = "\n";
+          for (int32_t hardware = 0; hardware < kHardwareCnt; hardware++) {
+            fprintf(file, "%s{\"name\":\"%s\",\"wait\":", separator, hardwareName[hardware]);
+            PrintMetricsJSON(file, total.hardwareWait[hardware]);
+            fprintf(file, ",\"depth\":");
+            PrintMetricsJSON(file, total.hardwareDepth[hardware]);
+            fprintf(file, "}");
+            separator = ",\n";
+          }
+          fprintf(file, "\n]}\n");
+          fclose(file);
+        }
+    )";
   }
 }
 
-void DFS_RegisterInstanceCall(
-    std::map<std::string, std::vector<std::string>> &operatorGraph,
-    std::set<std::string> &visited, const std::string &currentInstance,
-    std::string &ir) {
-  if (visited.count(currentInstance)) {
-    return;
+/*
+  Discrete-event instance table: simu registers everything before the event
+  loop runs, so the table only grows. Columns are dense vectors indexed by
+  instance id (id 0 is never handed out) and predecessors are stored CSR.
+*/
+void SIMIRBuilder::EmitInstanceMap(SIMTranslationUnit *unit) {
+  out << R"(
+        // ids [begin, end)
+        struct IdRange {
+          uint64_t begin, end;
+        };
+
+        std::vector<int32_t> instanceToOperator{-1};
+        // predecessors of id: instancePreId[instancePreOffset[id], instancePreOffset[id + 1])
+        std::vector<uint64_t> instancePreOffset{0, 0};
+        std::vector<uint64_t> instancePreId;
+        uint64_t topInstanceId;
+  )";
+  if (!tracePath.empty()) {
+    out << "\tstd::vector<const char *> instanceFlow{nullptr};\n";
   }
-  auto &vec = operatorGraph.at(currentInstance);
+}
 
-  // 处理开头的图op
-  if (vec.size() == 0) {
-    ir += StringFormat(
-        "\t    const std::vector<uint64_t> &preid_%s = _instancePreId;\n",
-        currentInstance.c_str());
-    ir += GetFlowCallOrOperatorCall(currentInstance);
-    visited.insert(currentInstance);
-    return;
+/*
+  Wall-clock instance table, a struct of arrays over a ring of
+  kInstanceWindow slots (--window, the `window` block or 1024): instance `id` lives in slot id % kInstanceWindow.
+  Only the simu thread registers, so only it ever claims a slot; device
+  threads retire instances without any lock.
+
+    instancePendingCnt  predecessors not yet retired, plus one guard held
+                        while registerInstance is still linking the instance
+    instanceSuccessor   head of the successor list, kNoEdge or kRetiredEdge
+
+  Edges live in a ring of kEdgeWindow entries. Only live predecessors get
+  an edge: it names its owner, the successor, and is pushed onto the
+  successor list of the predecessor, which retireInstance walks to release
+  the owners. Linking never allocates, and an edge is reused once its owner
+  retired. An instance whose live predecessors would fill the whole ring
+  waits for the rest to retire instead of linking them.
+*/
+void SIMIRBuilder::EmitInstanceSlotTable(SIMTranslationUnit *unit) {
+  uint64_t window = instanceWindow;
+  if (window <= 0) {
+    window = unit->window != nullptr ? unit->window->size : 1024;
   }
+  // queues never hold more than the window, rounded up to a power of two
+  uint64_t queueCapacity = 1;
+  while (queueCapacity < window) {
+    queueCapacity <<= 1;
+  }
+  out.Format(R"(
+        constexpr uint64_t kInstanceWindow = %lu;
+        constexpr uint64_t kQueueCapacity = %lu;
+)",
+             window, queueCapacity);
+  out << R"(
+        // ids [begin, end)
+        struct IdRange {
+          uint64_t begin, end;
+        };
 
-  // 处理当前图op的前驱
-  ir += StringFormat("\t    std::vector<uint64_t> preid_%s;\n",
-                     currentInstance.c_str());
-  for (auto &preInstance : operatorGraph.at(currentInstance)) {
-    if (!visited.count(preInstance)) {
-      DFS_RegisterInstanceCall(operatorGraph, visited, preInstance, ir);
-    }
+        constexpr uint64_t kEdgeWindow = kInstanceWindow * 8;
+        constexpr uint64_t kNoEdge = UINT64_MAX;
+        constexpr uint64_t kRetiredEdge = UINT64_MAX - 1;
 
-    if (g_OperatorTime.count(preInstance)) {
-      ir += StringFormat("\t    preid_%s.emplace_back(id_%s);\n",
-                         currentInstance.c_str(), preInstance.c_str());
-    } else if (g_ForeachCnt.count(preInstance)) {
-      for (int loopI = 0; loopI < g_ForeachCnt.at(preInstance); loopI++) {
-        ir += StringFormat(
-            "\t    preid_%s.insert(preid_%s.end(), id_%s_loop%d.begin(), "
-            "id_%s_loop%d.end());\n",
-            currentInstance.c_str(), currentInstance.c_str(),
-            preInstance.c_str(), loopI, preInstance.c_str(), loopI);
-      }
-    } else {
-      ir += StringFormat("\t    preid_%s.insert(preid_%s.end(), id_%s.begin(), "
-                         "id_%s.end());\n",
-                         currentInstance.c_str(), currentInstance.c_str(),
-                         preInstance.c_str(), preInstance.c_str());
-    }
+        std::atomic<uint64_t> instanceId[kInstanceWindow]; // 0: free
+        int32_t instanceOp[kInstanceWindow];
+        uint64_t instanceRank[kInstanceWindow];
+        std::atomic<int32_t> instancePendingCnt[kInstanceWindow];
+        std::atomic<uint64_t> instanceSuccessor[kInstanceWindow];
+
+        uint64_t preEdgeOwner[kEdgeWindow];
+        std::atomic<uint64_t> preEdgeNext[kEdgeWindow];
+        uint64_t topEdgeId;
+
+        inline uint64_t InstanceSlot(uint64_t id) { return id % kInstanceWindow; }
+        inline bool InstanceRetired(uint64_t id) {
+          return instanceId[InstanceSlot(id)].load(std::memory_order_acquire) != id;
+        }
+
+        uint64_t topInstanceId;
+        std::atomic<uint64_t> retiredInstanceCnt;
+        std::atomic<bool> simuDone, schedulerDone;
+        LockFreeQueue<uint64_t, kQueueCapacity> readyInstanceQueue;
+  )";
+  for (auto *expr : unit->hardware->exprs) {
+    out.Format(
+        "\tLockFreeQueue<uint64_t, kQueueCapacity> Hardware_%s_Queue;\n",
+        expr->hardwareName->name.c_str());
+  }
+  out << "\tLockFreeQueue<uint64_t, kQueueCapacity> *hardwareQueue[] = {";
+  for (auto *expr : unit->hardware->exprs) {
+    out.Format("&Hardware_%s_Queue, ",
+               expr->hardwareName->name.c_str());
+  }
+  out << "};\n";
+  // instances handed to a hardware queue and not yet retired
+  out.Format("\tstd::atomic<int32_t> hardwareInFlight[%d];\n",
+             (int32_t)unit->hardware->exprs.size());
+  if (!tracePath.empty()) {
+    out << "\tconst char *instanceFlow[kInstanceWindow];\n";
+  }
+  if (!tracePath.empty() || metrics) {
+    out << "\tint64_t instanceReadyTime[kInstanceWindow];\n";
+  }
+  if (metrics) {
+    out << R"(
+        // flow calls of simu, a ring like the instance slots; BeginInvocation
+        // waits for the call that last held its slot to finish
+        struct Invocation {
+          // instances not retired yet, plus a guard while simu registers
+          std::atomic<int64_t> pendingCnt;
+          int32_t flow;
+          int64_t issueTime;
+        };
+        Invocation invocation[kInstanceWindow];
+        uint64_t topInvocation, invocationFirstId;
+        uint64_t instanceInvocation[kInstanceWindow];
+        // ready instances of each hardware not started yet
+        std::atomic<int32_t> hardwareReadyCnt[kHardwareCnt];
+    )";
   }
+}
 
-  // 处理当前图op
-  if (g_OperatorTime.count(currentInstance)) {
-    ir += StringFormat(
-        "\t    uint64_t id_%s = registerInstance((void *)%s, preid_%s);\n",
-        currentInstance.c_str(), currentInstance.c_str(),
-        currentInstance.c_str());
-  } else if (g_ForeachCnt.count(currentInstance)) {
-    for (int loopI = 0; loopI < g_ForeachCnt.at(currentInstance); loopI++) {
-      ir += StringFormat("\t    auto id_%s_loop%d = %s(preid_%s);\n",
-                         currentInstance.c_str(), loopI,
-                         currentInstance.c_str(), currentInstance.c_str());
-    }
-  } else {
-    ir += StringFormat("\t    auto id_%s = %s(preid_%s);\n",
-                       currentInstance.c_str(), currentInstance.c_str(),
-                       currentInstance.c_str());
+/*
+  When the window is full the simu thread parks on a condition variable
+  until a device retires the instance it waits for; with --metrics it
+  also parks until the flow call holding the next call slot is done.
+  Devices only touch the mutex while producerParked is set; the fences on
+  both sides make sure either the producer sees the retirement or the
+  device sees the flag.
+
+  Threads that run out of work (the scheduler service, pool workers) park
+  on a Parking. Wake bumps its generation; a thread reads the generation
+  before it looks for work and only sleeps while it is unchanged, so a
+  Wake between the two is never lost.
+*/
+void SIMIRBuilder::EmitBackpressure(SIMTranslationUnit *unit) {
+  out << R"(
+        struct Parking {
+          std::mutex mutex;
+          std::condition_variable cond;
+          std::atomic<uint64_t> generation{0};
+          std::atomic<int32_t> parkedCnt{0};
+
+          void Wake() {
+            generation.fetch_add(1);
+            if (parkedCnt.load() > 0) {
+              std::lock_guard<std::mutex> lock(mutex);
+              cond.notify_all();
+            }
+          }
+
+          // until generation moved past seen, or wakeNs; INT64_MAX: no timeout
+          void Park(uint64_t seen, int64_t wakeNs) {
+            parkedCnt.fetch_add(1);
+            {
+              std::unique_lock<std::mutex> lock(mutex);
+              auto woken = [&] { return generation.load() != seen; };
+              if (wakeNs == INT64_MAX) {
+                cond.wait(lock, woken);
+              } else {
+                cond.wait_until(
+                    lock,
+                    std::chrono::steady_clock::time_point(std::chrono::nanoseconds(wakeNs)),
+                    woken);
+              }
+            }
+            parkedCnt.fetch_sub(1);
+          }
+        };
+
+        // the scheduler service, woken whenever an instance gets ready or
+        // retires
+        Parking serviceParking;
+
+        std::mutex backpressureMutex;
+        std::condition_variable backpressureCond;
+        std::atomic<bool> producerParked;
+        uint64_t producerStallCnt;
+        double producerStallTime;
+
+        // parks simu until done() holds, which only a retirement can change
+        template <typename Done> void WaitProducer(Done done) {
+          if (done()) {
+            return;
+          }
+          int64_t begin = NowNs();
+          {
+            std::unique_lock<std::mutex> lock(backpressureMutex);
+            producerParked.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!done()) {
+              backpressureCond.wait(lock);
+            }
+            producerParked.store(false, std::memory_order_relaxed);
+          }
+          producerStallCnt++;
+          producerStallTime += (NowNs() - begin) / 1e9;
+        }
+
+        void WaitRetired(uint64_t id) {
+          WaitProducer([id] { return InstanceRetired(id); });
+        }
+
+        void WakeProducer() {
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (producerParked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(backpressureMutex);
+            backpressureCond.notify_one();
+          }
+        }
+  )";
+  if (metrics) {
+    // a device runs InvocationDone before it retires the instance, so the
+    // WakeProducer of that retirement also wakes BeginInvocation
+    out << R"(
+        void BeginInvocation(int32_t flow) {
+          Invocation &call = invocation[++topInvocation % kInstanceWindow];
+          WaitProducer([&call] {
+            return call.pendingCnt.load(std::memory_order_acquire) == 0;
+          });
+          call.flow = flow;
+          call.issueTime = NowNs();
+          call.pendingCnt.store(1, std::memory_order_relaxed);
+          invocationFirstId = topInstanceId + 1;
+        }
+
+        // an instance of the call, or simu's guard, is done
+        void InvocationDone(uint64_t slot) {
+          Invocation &call = invocation[slot];
+          if (call.pendingCnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            LocalMetrics().flowLatency[call.flow].Record(NowNs() - call.issueTime);
+          }
+        }
+
+        void EndInvocation() {
+          uint64_t slot = topInvocation % kInstanceWindow;
+          if (topInstanceId < invocationFirstId) {
+            // no instance, no latency
+            invocation[slot].pendingCnt.store(0, std::memory_order_release);
+            return;
+          }
+          InvocationDone(slot);
+        }
+    )";
   }
-  visited.insert(currentInstance);
 }
 
-std::string GenRegisterInstanceCall(
-    std::map<std::string, std::vector<std::string>> &operatorGraph) {
-  std::set<std::string> visited;
-  std::string ir;
-  for (auto &[opName, preOpVec] : operatorGraph) {
-    if (!visited.count(opName)) {
-      DFS_RegisterInstanceCall(operatorGraph, visited, opName, ir);
-    }
+void SIMIRBuilder::EmitRegisterInstanceFunc(SIMTranslationUnit *unit) {
+  out << R"(
+        IdRange registerInstance(int32_t op, const IdRange *_pre, int32_t _preCnt,
+                                 uint64_t rank)
+        {
+            uint64_t id = ++topInstanceId;
+            uint64_t slot = InstanceSlot(id);
+            if (id > kInstanceWindow) {
+              WaitRetired(id - kInstanceWindow);
+            }
+            int32_t preCnt = 0;
+            for (int32_t r = 0; r < _preCnt; r++) {
+              preCnt += _pre[r].end - _pre[r].begin;
+            }
+            instanceOp[slot] = op;
+            instanceRank[slot] = rank;
+  )";
+  if (!tracePath.empty()) {
+    out << "\t    instanceFlow[slot] = traceFlow;\n";
+  }
+  if (metrics) {
+    out << "\t    instanceInvocation[slot] = topInvocation % kInstanceWindow;\n"
+           "\t    invocation[instanceInvocation[slot]].pendingCnt.fetch_add(\n"
+           "\t        1, std::memory_order_relaxed);\n";
   }
+  out << R"(
+            instancePendingCnt[slot].store(preCnt + 1, std::memory_order_relaxed);
+            instanceSuccessor[slot].store(kNoEdge, std::memory_order_relaxed);
+            instanceId[slot].store(id, std::memory_order_release);
 
-  ir += "\n\t    std::vector<uint64_t> ret;";
-  ir += "\n";
-  for (auto &[opName, preOpVec] : operatorGraph) {
-    if (g_OperatorTime.count(opName)) {
-      ir += StringFormat("\t    ret.emplace_back(id_%s);", opName.c_str());
-    } else if (g_ForeachCnt.count(opName)) {
-      for (int32_t loopI = 0; loopI < g_ForeachCnt.at(opName); loopI++) {
-        ir += StringFormat("\t    ret.insert(ret.end(), id_%s_loop%d.begin(), "
-                           "id_%s_loop%d.end());\n",
-                           opName.c_str(), loopI, opName.c_str(), loopI);
-      }
-    } else {
-      ir += StringFormat("\t    ret.insert(ret.end(), id_%s.begin(), "
-                         "id_%s.end());\n",
-                         opName.c_str(), opName.c_str());
-    }
-    ir += "\n";
+            // edges [firstEdgeId, topEdgeId) belong to id and stay linked
+            // until id retires, so they are never reused here
+            uint64_t firstEdgeId = topEdgeId;
+            int32_t doneCnt = 1;
+            for (int32_t r = 0; r < _preCnt; r++) {
+              for (uint64_t preId = _pre[r].begin; preId < _pre[r].end; preId++) {
+                if (InstanceRetired(preId)) {
+                  doneCnt++;
+                  continue;
+                }
+                if (topEdgeId - firstEdgeId == kEdgeWindow) {
+                  WaitRetired(preId);
+                  doneCnt++;
+                  continue;
+                }
+                uint64_t edge = topEdgeId % kEdgeWindow;
+                if (topEdgeId >= kEdgeWindow) {
+                  WaitRetired(preEdgeOwner[edge]);
+                }
+                topEdgeId++;
+                preEdgeOwner[edge] = id;
+                std::atomic<uint64_t> &head = instanceSuccessor[InstanceSlot(preId)];
+                uint64_t next = head.load(std::memory_order_acquire);
+                do {
+                  if (next == kRetiredEdge) {
+                    doneCnt++;
+                    break;
+                  }
+                  preEdgeNext[edge].store(next, std::memory_order_relaxed);
+                } while (!head.compare_exchange_weak(next, edge, std::memory_order_acq_rel));
+              }
+            }
+            if (instancePendingCnt[slot].fetch_sub(doneCnt, std::memory_order_acq_rel) == doneCnt) {
+  )";
+  if (!tracePath.empty() || metrics) {
+    out << "\t      instanceReadyTime[slot] = NowNs();\n";
+  }
+  if (metrics) {
+    out << "\t      hardwareReadyCnt[(int)operatorHardware[op]].fetch_add(\n"
+           "\t          1, std::memory_order_relaxed);\n";
   }
-  return ir;
+  out << R"(
+              readyInstanceQueue.push(id);
+              serviceParking.Wake();
+            }
+            return {id, id + 1};
+        }
+
+        // called by the device that executed id, releases its successors
+        void retireInstance(uint64_t id)
+        {
+            uint64_t slot = InstanceSlot(id);
+            hardwareInFlight[(int)operatorHardware[instanceOp[slot]]].fetch_sub(
+                1, std::memory_order_release);
+            uint64_t edge =
+                instanceSuccessor[slot].exchange(kRetiredEdge, std::memory_order_acq_rel);
+            while (edge != kNoEdge) {
+              // the owner may run and retire as soon as it is released, so
+              // read the edge before that
+              uint64_t next = preEdgeNext[edge].load(std::memory_order_relaxed);
+              uint64_t successorId = preEdgeOwner[edge];
+              if (instancePendingCnt[InstanceSlot(successorId)].fetch_sub(
+                      1, std::memory_order_acq_rel) == 1) {
+  )";
+  if (!tracePath.empty() || metrics) {
+    out << "\t        instanceReadyTime[InstanceSlot(successorId)] = NowNs();\n";
+  }
+  if (metrics) {
+    out << "\t        hardwareReadyCnt[(int)operatorHardware[instanceOp[\n"
+           "\t            InstanceSlot(successorId)]]].fetch_add(\n"
+           "\t            1, std::memory_order_relaxed);\n";
+  }
+  out << R"(
+                readyInstanceQueue.push(successorId);
+              }
+              edge = next;
+            }
+            instanceId[slot].store(0, std::memory_order_release);
+            retiredInstanceCnt.fetch_add(1, std::memory_order_release);
+            WakeProducer();
+            serviceParking.Wake();
+        }
+  )";
 }
 
-void GetFlowExprGraph(std::map<std::string, std::vector<std::string>> &subRet,
-                      SIMFlowExpression *&preExpr, SIMFlowExpression *flowExpr,
-                      const int32_t beginExprId, int32_t &depthCnt,
-                      const std::string &flowBlockName) {
-  auto OperatorExprToString = [beginExprId, &depthCnt,
-                               &flowBlockName](SIMFlowExpression *expr) {
-    std::string opName;
-    if (SIMFlowUnaryExpression *unaryExpr =
-            dynamic_cast<SIMFlowUnaryExpression *>(expr)) {
-      opName = unaryExpr->opName->name;
-    } else if (SIMForeachExpression *foreachExpr =
-                   dynamic_cast<SIMForeachExpression *>(expr)) {
-      opName = StringFormat("%s_%dFE%d", flowBlockName.c_str(), beginExprId,
-                            depthCnt);
-      if (g_ForeachExprIR.count(opName) == 0) {
-        std::string foreachIR;
-        foreachIR += StringFormat(
-            "\n\tstd::vector<uint64_t> %s(const std::vector<uint64_t> "
-            "&_instancePreId) {\n",
-            opName.c_str());
-        auto operatorGraph = GetOperatorGraph(
-            opName, dynamic_cast<SIMFlowBlock *>(foreachExpr->loopBlock));
-        for (auto &[opExpr, preOpExprVec] : operatorGraph) {
-          for (auto preOpExpr : preOpExprVec) {
-            foreachIR += "\t//    " + opExpr + " <- " + preOpExpr + "\n";
-          }
+void SIMIRBuilder::EmitTheoreticalTimeArray(SIMTranslationUnit *unit) {
+  out << "\n";
+  for (auto *expr : unit->hardware->exprs) {
+    out.Format("\tdouble %s_TheoreticalTime[%d];\n",
+               expr->hardwareName->name.c_str(), expr->hardwareCnt);
+  }
+  out << "\tdouble *hardwareTheoreticalTime[] = {";
+  for (auto *expr : unit->hardware->exprs) {
+    out.Format("%s_TheoreticalTime, ",
+               expr->hardwareName->name.c_str());
+  }
+  out << "};\n";
+}
+
+/*
+  Virtual registerInstance: simu runs to completion before the event loop
+  starts, so there is no in-flight window and no lock. Each instance is
+  stamped with the virtual time at which simu issued it.
+*/
+void SIMIRBuilder::EmitVirtualRegisterInstanceFunc(
+    SIMTranslationUnit *unit) {
+  out << R"(
+        std::vector<uint64_t> instanceReleaseTime{0};
+        std::vector<uint64_t> instanceRank{0};
+        uint64_t virtualNow;
+  )";
+  if (metrics) {
+    out << R"(
+        // flow calls of simu and the call each instance was registered by
+        std::vector<int32_t> invocationFlow;
+        std::vector<uint64_t> invocationTime;
+        std::vector<uint64_t> instanceInvocation{0};
+
+        void BeginInvocation(int32_t flow) {
+          invocationFlow.emplace_back(flow);
+          invocationTime.emplace_back(virtualNow);
         }
-        foreachIR += GenRegisterInstanceCall(operatorGraph);
-        foreachIR += "\t    return ret;\n";
-        foreachIR += "\t}\n";
-        g_ForeachExprIR[opName] = foreachIR;
-        g_ForeachExprIRHeader[opName] = StringFormat(
-            "\n\tstd::vector<uint64_t> %s(const std::vector<uint64_t> "
-            "&_instancePreId);",
-            opName.c_str());
-        g_ForeachCnt[opName] = foreachExpr->loopCnt;
-      }
-    } else {
-      throw std::logic_error("Unsupported FlowExpression!");
-    }
-    return opName;
-  };
-
-  if (SIMFlowBinaryExpression *binaryExpr =
-          dynamic_cast<SIMFlowBinaryExpression *>(flowExpr)) {
-    GetFlowExprGraph(subRet, preExpr, binaryExpr->leftExpr, beginExprId,
-                     depthCnt, flowBlockName);
-    std::string preOp = OperatorExprToString(preExpr);
-    depthCnt++;
-    std::string curOp = OperatorExprToString(binaryExpr->rightExpr);
-    subRet[curOp].emplace_back(preOp);
-    preExpr = binaryExpr->rightExpr;
-  } else if (SIMFlowUnaryExpression *unaryExpr =
-                 dynamic_cast<SIMFlowUnaryExpression *>(flowExpr)) {
-    preExpr = unaryExpr;
-    if (depthCnt == 0) {
-      auto name = OperatorExprToString(preExpr);
-      if (subRet[name].size() == 0) {
-        subRet[name] = std::vector<std::string>();
-      }
-    }
-  } else if (SIMForeachExpression *foreachExpr =
-                 dynamic_cast<SIMForeachExpression *>(flowExpr)) {
-    preExpr = foreachExpr;
-    if (depthCnt == 0) {
-      auto name = OperatorExprToString(preExpr);
-      if (subRet[name].size() == 0) {
-        subRet[name] = std::vector<std::string>();
-      }
-    }
-  } else {
-    throw std::logic_error("Unsupported FlowExpression!");
+    )";
+  }
+  out << R"(
+
+        IdRange registerInstance(int32_t op, const IdRange *_pre, int32_t _preCnt,
+                                 uint64_t rank)
+        {
+            instanceToOperator.emplace_back(op);
+            instanceReleaseTime.emplace_back(virtualNow);
+            instanceRank.emplace_back(rank);
+  )";
+  if (!tracePath.empty()) {
+    out << "\t    instanceFlow.emplace_back(traceFlow);\n";
+  }
+  if (metrics) {
+    out << "\t    instanceInvocation.emplace_back(invocationFlow.size() - 1);\n";
   }
+  out << R"(
+            for (int32_t r = 0; r < _preCnt; r++) {
+              for (uint64_t preId = _pre[r].begin; preId < _pre[r].end; preId++) {
+                instancePreId.emplace_back(preId);
+              }
+            }
+            instancePreOffset.emplace_back(instancePreId.size());
+            uint64_t id = ++topInstanceId;
+            return {id, id + 1};
+        }
+  )";
 }
 
-/* key: opInstance, value: preOpInstance */
-std::map<std::string, std::vector<std::string>>
-GetOperatorGraph(const std::string &flowBlockName, SIMFlowBlock *block) {
-  std::map<std::string, std::vector<std::string>> ret;
-  for (int exprId = 0; exprId < block->exprs.size(); exprId++) {
-    std::map<std::string, std::vector<std::string>> subRet;
-    SIMFlowExpression *preExpr = nullptr;
-    int32_t depthCnt = 0;
-    GetFlowExprGraph(subRet, preExpr, block->exprs[exprId], exprId, depthCnt,
-                     flowBlockName);
+/*
+  Flow functions register straight into the instance table and return
+  nothing: ids are handed out densely by the simu thread only, so whatever a
+  call registered is [topInstanceId + 1 before, topInstanceId + 1 after).
+  Every node therefore ends up as one `IdRange id_<node>` and a node's
+  predecessors are a stack array of their ranges, whatever the foreach
+  counts are.
 
-    for (auto &[name, vec] : subRet) {
-      ret[name].insert(ret[name].end(), vec.begin(), vec.end());
-    }
+  Instances are registered with `_tailRank + rank of the node`; a called
+  flow gets the tail that puts its own critical path on top of it, see
+  SIMEngine::Instantiate.
+
+IR demo for `a -> foreach(50) { g; } -> c;` in flow f, g = { a -> b -> c; }
+and every operator taking 1 ms:
+
+  IdRange id_a = registerInstance((int32_t)Operator::a, _pre, _preCnt, _tailRank + 5);
+  const IdRange preid_f_0FE1[] = {id_a, };
+  uint64_t begin_f_0FE1 = topInstanceId + 1;
+  for (int32_t loopI = 0; loopI < 50; loopI++) {
+    f_0FE1(preid_f_0FE1, 1, _tailRank + 1);
   }
-  return ret;
+  IdRange id_f_0FE1 = {begin_f_0FE1, topInstanceId + 1};
+*/
+void EmitNodeCall(SIMIRWriter &out, const SIMTaskGraph &graph,
+                  const SIMTaskGraph::Node &node, const char *preId,
+                  const char *preCnt) {
+  const char *name = node.name.c_str();
+  if (node.op >= 0) {
+    out.Format("\t    IdRange id_%s = registerInstance("
+               "(int32_t)Operator::%s, %s, %s, _tailRank + %lu);\n",
+               name, graph.operators[node.op].name.c_str(), preId, preCnt,
+               node.rank);
+    return;
+  }
+  uint64_t tailRank = node.rank - graph.flows[node.flow].criticalPath;
+  out.Format("\t    uint64_t begin_%s = topInstanceId + 1;\n", name);
+  if (node.repeat != 1) {
+    out.Format("\t    for (int32_t loopI = 0; loopI < %d; loopI++) {\n"
+               "\t      %s(%s, %s, _tailRank + %lu);\n"
+               "\t    }\n",
+               node.repeat, graph.flows[node.flow].name.c_str(), preId, preCnt,
+               tailRank);
+  } else {
+    out.Format("\t    %s(%s, %s, _tailRank + %lu);\n",
+               graph.flows[node.flow].name.c_str(), preId, preCnt, tailRank);
+  }
+  out.Format("\t    IdRange id_%s = {begin_%s, topInstanceId + 1};\n", name,
+             name);
 }
 
-std::string SIMIRBuilder::EmitFlowFunc(SIMTranslationUnit *unit) {
-  std::string ret;
-  for (auto &[sym, block] : unit->flowBlocks) {
-    ret +=
-        StringFormat("\n\tstd::vector<uint64_t> %s(const std::vector<uint64_t> "
-                     "&_instancePreId) {\n",
-                     sym->name.c_str());
-    auto operatorGraph = GetOperatorGraph(sym->name, block);
-    for (auto &[opExpr, preOpExprVec] : operatorGraph) {
-      for (auto preOpExpr : preOpExprVec) {
-        ret += "\t//    " + opExpr + " <- " + preOpExpr + "\n";
-      }
+// nodes are already in registration order, predecessors first
+void EmitFlowFuncBody(SIMIRWriter &out, const SIMTaskGraph &graph,
+                      int32_t flow) {
+  auto &nodes = graph.flows[flow].nodes;
+  out.Format("\n\tvoid %s(const IdRange *_pre, int32_t _preCnt, "
+             "uint64_t _tailRank) {\n",
+             graph.flows[flow].name.c_str());
+  for (auto &node : nodes) {
+    for (int32_t pre : node.preNodes) {
+      out << "\t//    " << node.name << " <- " << nodes[pre].name << "\n";
+    }
+  }
+  for (auto &node : nodes) {
+    if (node.preNodes.empty()) {
+      EmitNodeCall(out, graph, node, "_pre", "_preCnt");
+      continue;
+    }
+    out.Format("\t    const IdRange preid_%s[] = {", node.name.c_str());
+    for (int32_t pre : node.preNodes) {
+      out << "id_" << nodes[pre].name << ", ";
     }
-    ret += GenRegisterInstanceCall(operatorGraph);
-    ret += "\t    return ret;\n";
-    ret += "\t}\n";
+    out << "};\n";
+    std::string preId = "preid_" + node.name;
+    EmitNodeCall(out, graph, node, preId.c_str(),
+                 std::to_string(node.preNodes.size()).c_str());
   }
+  out << "\t}\n";
+}
 
-  std::string foreachIR;
-  for (auto &[name, header] : g_ForeachExprIRHeader) {
-    foreachIR += header;
+/*
+  Every flow and foreach body is declared up front, so the definitions can
+  follow in any order. Each user flow is followed by its foreach bodies,
+  which is the unit SIMFlowCache stores. Blocks only read the graph: they
+  are formatted on `jobs` threads, one wave of blocks at a time, and
+  written in flow order, so the output does not depend on the thread count
+  or on what was cached.
+*/
+void SIMIRBuilder::EmitFlowFunc(SIMTranslationUnit *unit) {
+  for (auto &flow : graph.flows) {
+    out.Format("\n\tvoid %s(const IdRange *_pre, int32_t _preCnt, "
+               "uint64_t _tailRank);",
+               flow.name.c_str());
   }
-  foreachIR += "\n";
-  for (auto &[name, ir] : g_ForeachExprIR) {
-    foreachIR += ir;
+  out << "\n";
+
+  int32_t userFlowCnt = unit->flowBlocks.size();
+  int32_t waveSize = SIMJobCnt(jobs, userFlowCnt) * 16;
+  std::vector<std::string> chunks(waveSize);
+  for (int32_t waveBegin = 0; waveBegin < userFlowCnt;
+       waveBegin += waveSize) {
+    int32_t waveCnt = std::min(waveSize, userFlowCnt - waveBegin);
+    SIMParallelFor(waveCnt, jobs, [&](int32_t i, int32_t) {
+      auto &flow = graph.flows[waveBegin + i];
+      auto cached = cachedText.find(flow.name);
+      if (cached != cachedText.end()) {
+        chunks[i] = std::move(cached->second);
+        return;
+      }
+      std::ostringstream os;
+      SIMIRWriter writer;
+      writer.Open(os);
+      EmitFlowFuncBody(writer, graph, waveBegin + i);
+      for (int32_t body = flow.foreachBegin; body < flow.foreachEnd; body++) {
+        EmitFlowFuncBody(writer, graph, body);
+      }
+      writer.Flush();
+      chunks[i] = os.str();
+
+      auto key = cache.keys.find(flow.name);
+      if (key != cache.keys.end()) {
+        SIMFlowCacheEntry entry;
+        entry.stub.criticalPath = flow.criticalPath;
+        for (int32_t body = flow.foreachBegin; body < flow.foreachEnd;
+             body++) {
+          entry.stub.foreachNames.emplace_back(graph.flows[body].name);
+        }
+        entry.text = chunks[i];
+        cache.Store(key->second, entry);
+      }
+    });
+    for (int32_t i = 0; i < waveCnt; i++) {
+      out << chunks[i];
+    }
   }
+}
 
-  ret = foreachIR + ret;
-  return ret;
+// index of every flow in graph.flows, as flowName lists them
+static std::map<std::string, int32_t> FlowIds(const SIMTaskGraph &graph) {
+  std::map<std::string, int32_t> flowIds;
+  for (int32_t i = 0; i < graph.flows.size(); i++) {
+    flowIds[graph.flows[i].name] = i;
+  }
+  return flowIds;
 }
 
-std::string VisitSIMBlock(SIMIRBuilder &builder, SIMSimuBlock *block,
-                          int32_t depth) {
-  std::string ret;
+// trace: name the flow in traceFlow before calling it; flowIds: wrap
+// every call in BeginInvocation / EndInvocation for the latency metrics
+void VisitSIMBlock(SIMIRWriter &out, SIMSimuBlock *block, int32_t depth,
+                   bool virtualTime, bool trace,
+                   const std::map<std::string, int32_t> *flowIds) {
   std::string space = "    ";
   for (int i = 0; i < depth; i++) {
     space += "    ";
   }
   for (auto *expr : block->exprs) {
     if (SIMCallExpression *callExpr = dynamic_cast<SIMCallExpression *>(expr)) {
+      if (callExpr->name == nullptr) {
+        continue;
+      }
       if (callExpr->name->name != "sleep") {
-        ret += StringFormat("\t%s%s({});\n", space.c_str(),
-                            callExpr->name->name.c_str());
+        if (trace) {
+          out.Format("\t%straceFlow = \"%s\";\n", space.c_str(),
+                     callExpr->name->name.c_str());
+        }
+        if (flowIds != nullptr) {
+          out.Format("\t%sBeginInvocation(%d);\n", space.c_str(),
+                     flowIds->at(callExpr->name->name));
+        }
+        out.Format("\t%s%s(nullptr, 0, 0);\n", space.c_str(),
+                   callExpr->name->name.c_str());
+        if (flowIds != nullptr && !virtualTime) {
+          out.Format("\t%sEndInvocation();\n", space.c_str());
+        }
+      } else if (virtualTime) {
+        out.Format("\t%svirtualNow += %" PRId64 ";\n", space.c_str(),
+                   callExpr->arg0);
       } else {
-        ret += StringFormat("\t%susleep(%d * 1000);\n", space.c_str(),
-                            callExpr->arg0);
+        out.Format("\t%sWaitUntil(NowNs() + %" PRId64 ");\n", space.c_str(),
+                   callExpr->arg0);
       }
     } else if (SIMForeachExpression *foreachExpr =
                    dynamic_cast<SIMForeachExpression *>(expr)) {
-      ret += StringFormat("\t%sfor(int %s = 0; %s < %d; %s++) {\n",
-                          space.c_str(), "i", "i", foreachExpr->loopCnt, "i");
-      ret += VisitSIMBlock(builder,
-                           dynamic_cast<SIMSimuBlock *>(foreachExpr->loopBlock),
-                           depth + 1);
-      ret += StringFormat("\t%s}\n", space.c_str());
+      out.Format("\t%sfor(int %s = 0; %s < %d; %s++) {\n", space.c_str(), "i",
+                 "i", foreachExpr->loopCnt, "i");
+      VisitSIMBlock(out, dynamic_cast<SIMSimuBlock *>(foreachExpr->loopBlock),
+                    depth + 1, virtualTime, trace, flowIds);
+      out.Format("\t%s}\n", space.c_str());
     }
   }
-  return ret;
 }
 
-std::string SIMIRBuilder::EmitSimuFunc(SIMTranslationUnit *unit) {
-  std::string ret = R"(
+void SIMIRBuilder::EmitSimuFunc(SIMTranslationUnit *unit) {
+  out << R"(
         void simu() {
   )";
-  ret += VisitSIMBlock(*this, unit->simu, 0);
-  ret += "\t}\n";
-  return ret;
+  std::map<std::string, int32_t> flowIds = FlowIds(graph);
+  VisitSIMBlock(out, unit->simu, 0, false, !tracePath.empty(),
+                metrics ? &flowIds : nullptr);
+  out << "\t}\n";
 }
 
-std::string SIMIRBuilder::EmitSpinLockClass(SIMTranslationUnit *unit) {
-  std::string ret = R"(
-        class SpinLock {
+void SIMIRBuilder::EmitVirtualSimuFunc(SIMTranslationUnit *unit) {
+  out << R"(
+        void simu() {
+  )";
+  std::map<std::string, int32_t> flowIds = FlowIds(graph);
+  VisitSIMBlock(out, unit->simu, 0, true, !tracePath.empty(),
+                metrics ? &flowIds : nullptr);
+  out << "\t}\n";
+}
+
+/*
+  Bounded MPMC queue (Vyukov): every cell carries a sequence number, so
+  producers and consumers only contend on their own position counter and
+  never take a lock. N must be a power of two; push spins while full, which
+  cannot happen for queues sized to the in-flight window.
+*/
+void SIMIRBuilder::EmitLockFreeQueueClass(SIMTranslationUnit *unit) {
+  out << R"(
+        template <typename T, size_t N>
+        class LockFreeQueue {
         public:
-          SpinLock() : flag_(false) {}
-          void lock() {
-            bool expect = false;
-            while (!flag_.compare_exchange_weak(expect, true)) {
-              expect = false;
+          static_assert((N & (N - 1)) == 0, "N must be a power of two");
+          LockFreeQueue() {
+            for (size_t i = 0; i < N; i++) {
+              cells_[i].seq.store(i, std::memory_order_relaxed);
+            }
+          }
+          bool tryPush(const T &value) {
+            size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+            while (true) {
+              Cell &cell = cells_[pos & (N - 1)];
+              size_t seq = cell.seq.load(std::memory_order_acquire);
+              intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+              if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed)) {
+                  cell.value = value;
+                  cell.seq.store(pos + 1, std::memory_order_release);
+                  return true;
+                }
+              } else if (diff < 0) {
+                return false;
+              } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+              }
+            }
+          }
+          void push(const T &value) {
+            while (!tryPush(value)) {
+              std::this_thread::yield();
+            }
+          }
+          bool pop(T &value) {
+            size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+            while (true) {
+              Cell &cell = cells_[pos & (N - 1)];
+              size_t seq = cell.seq.load(std::memory_order_acquire);
+              intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+              if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed)) {
+                  value = cell.value;
+                  cell.seq.store(pos + N, std::memory_order_release);
+                  return true;
+                }
+              } else if (diff < 0) {
+                return false;
+              } else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+              }
             }
           }
-          void unlock() { flag_.store(false); }
         private:
-          std::atomic<bool> flag_;
+          struct alignas(64) Cell {
+            std::atomic<size_t> seq;
+            T value;
+          };
+          Cell cells_[N];
+          alignas(64) std::atomic<size_t> enqueuePos_{0};
+          alignas(64) std::atomic<size_t> dequeuePos_{0};
         };
-        SpinLock aliveInstanceMutex;
   )";
-  return ret;
 }
 
 /*
-HardwareQueuePushCall IR demo:
+  The scheduler service hands every batch of ready instances to a Scheduler
+  and calls Dispatch on each turn of its loop. Device queues are shared per
+  hardware and devices pop them in FIFO order, so a policy that wants to
+  order instances holds them back and only feeds a hardware while it has an
+  idle device; hardwareInFlight counts what is queued or running.
 
-  if (curInstanceType == Hardware::CPU) {
-    Hardware_CPU_Queue.push(id);
-  } else if (curInstanceType == Hardware::NPU) {
-    Hardware_NPU_Queue.push(id);
-  } else if (curInstanceType == Hardware::GPU) {
-    Hardware_GPU_Queue.push(id);
-  }
+    FifoScheduler          forwards instances in the order they became ready
+    CriticalPathScheduler  feeds the highest upward rank first, ties in ready
+                           order, like SIMEngine under --scheduler=cp
 */
-std::string GenHardwareQueuePushCall(SIMTranslationUnit *unit) {
-  std::string ret;
-
-  for (int i = 0; i < unit->hardware->exprs.size(); i++) {
-    if (i == 0) {
-      ret += StringFormat(R"(
-              if (curInstanceType == Hardware::%s) {
-                Hardware_%s_Queue.push(id);)",
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          unit->hardware->exprs[i]->hardwareName->name.c_str());
-    } else {
-      ret += StringFormat(R"(
-              } else if (curInstanceType == Hardware::%s) {
-                Hardware_%s_Queue.push(id);)",
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          unit->hardware->exprs[i]->hardwareName->name.c_str());
-    }
+void SIMIRBuilder::EmitScheduler(SIMTranslationUnit *unit) {
+  if (devicePool) {
+    out << R"(
+        // pool workers park here while none of their devices can finish or
+        // start; woken by every push to a hardware queue
+        Parking workerParking;
+
+        void WakeDeviceWorkers() { workerParking.Wake(); }
+    )";
+  } else {
+    out << "\n\tvoid WakeDeviceWorkers() {}\n";
   }
-  ret += "\n\t      }\n";
-  return ret;
+  out << R"(
+        struct Scheduler {
+          virtual ~Scheduler() {}
+          virtual void Schedule(std::vector<uint64_t> &instanceHeader) = 0;
+          virtual void Dispatch() {}
+        };
+
+        struct FifoScheduler : Scheduler {
+          void Schedule(std::vector<uint64_t> &instanceHeader) override {
+            for (auto id : instanceHeader) {
+              int hardware = (int)operatorHardware[instanceOp[InstanceSlot(id)]];
+              hardwareInFlight[hardware].fetch_add(1, std::memory_order_relaxed);
+              hardwareQueue[hardware]->push(id);
+            }
+            WakeDeviceWorkers();
+          }
+        };
+
+        struct CriticalPathScheduler : Scheduler {
+          // (rank, -ready order, id)
+          std::priority_queue<std::tuple<uint64_t, int64_t, uint64_t>>
+              readyHeap[std::size(hardwareQueue)];
+          int64_t readyCnt = 0;
+
+          void Schedule(std::vector<uint64_t> &instanceHeader) override {
+            for (auto id : instanceHeader) {
+              uint64_t slot = InstanceSlot(id);
+              readyHeap[(int)operatorHardware[instanceOp[slot]]].emplace(
+                  instanceRank[slot], -readyCnt++, id);
+            }
+            Dispatch();
+          }
+
+          void Dispatch() override {
+            bool pushed = false;
+            for (auto &[hardware, cnt] : hardwareCnt) {
+              auto &heap = readyHeap[(int)hardware];
+              auto &inFlight = hardwareInFlight[(int)hardware];
+              while (!heap.empty() &&
+                     inFlight.load(std::memory_order_acquire) < cnt) {
+                inFlight.fetch_add(1, std::memory_order_relaxed);
+                hardwareQueue[(int)hardware]->push(std::get<2>(heap.top()));
+                heap.pop();
+                pushed = true;
+              }
+            }
+            if (pushed) {
+              WakeDeviceWorkers();
+            }
+          }
+        };
+  )";
+  out.Format("\n\tScheduler *scheduler = new %s;\n",
+             scheduler == SIMSchedulerPolicy::CriticalPath
+                          ? "CriticalPathScheduler"
+                          : "FifoScheduler");
 }
 
 /*
-tmpQueuePushCall IR demo:
+UsageTablePrintCall IR demo, expects `totalTime` and `<HW>_TheoreticalTime`
+in seconds:
 
-  if (curInstanceType == Hardware::CPU) {
-    tmpCPUQueue.emplace_back(successorId);
-  } else if (curInstanceType == Hardware::NPU) {
-    tmpNPUQueue.emplace_back(successorId);
-  } else if (curInstanceType == Hardware::GPU) {
-    tmpGPUQueue.emplace_back(successorId);
-  }
+  printf("%s\t\t%.9lf\t\t%.9lf\t\t%.1lf%%\n", "CPU_0", CPU_TheoreticalTime[0],
+         totalTime - CPU_TheoreticalTime[0],
+         totalTime > 0 ? CPU_TheoreticalTime[0] * 100 / totalTime : 0.0);
 */
-std::string GenTmpQueuePushCall(SIMTranslationUnit *unit,
-                                const std::string &idSymbolName) {
-  std::string ret;
-
-  for (int i = 0; i < unit->hardware->exprs.size(); i++) {
-    if (i == 0) {
-      ret += StringFormat(R"(
-              if (curInstanceType == Hardware::%s) {
-                tmp%sQueue.emplace_back(%s);)",
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          idSymbolName.c_str());
-    } else {
-      ret += StringFormat(R"(
-              } else if (curInstanceType == Hardware::%s) {
-                tmp%sQueue.emplace_back(%s);)",
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                          idSymbolName.c_str());
+void GenUsageTablePrintCall(SIMIRWriter &out, SIMTranslationUnit *unit) {
+  out << R"(
+            printf("\n\nHARDWARE\tBUSY_TIME\tIDLE_TIME\tUSAGE\n\n");
+  )";
+  for (auto *expr : unit->hardware->exprs) {
+    for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
+      out << R"(
+            printf("%s\t\t%.9lf\t\t%.9lf\t\t%.1lf%%\n", )";
+      out.Format(
+          R"("%s_%d", %s_TheoreticalTime[%d], totalTime - %s_TheoreticalTime[%d],
+                          totalTime > 0 ? %s_TheoreticalTime[%d] * 100 / totalTime : 0.0);
+      )",
+          expr->hardwareName->name.c_str(), deviceId,
+          expr->hardwareName->name.c_str(), deviceId,
+          expr->hardwareName->name.c_str(), deviceId,
+          expr->hardwareName->name.c_str(), deviceId);
     }
   }
-  ret += "\n\t      }\n";
-  return ret;
 }
 
-std::string SIMIRBuilder::EmitSimpleScheduler(SIMTranslationUnit *unit) {
-  std::string ret = R"(
-        void SimpleScheduler(std::vector<uint64_t> &instanceHeader) {
-
-          for (auto id : instanceHeader) {
-              auto curInstanceType = operatorToHardwareTime.at(instanceToOperator.at(id)).first;
-      )";
-
-  ret += GenHardwareQueuePushCall(unit);
-
-  ret += R"(
-              aliveInstanceId.at(id) = 1;
+/*
+  Device threads pop their hardware queue, run the operator and retire the
+  instance; the scheduler service drains readyInstanceQueue in batches into
+  the scheduler until simu is done and every instance retired.
+*/
+void SIMIRBuilder::EmitHardwareExecuteFunc(SIMTranslationUnit *unit) {
+  out << R"(
+        void HardwareExecute(LockFreeQueue<uint64_t, kQueueCapacity> &queue,
+                             double *theoreticalTime, int32_t deviceId) {
+          uint64_t id;
+          while (true) {
+            if (!queue.pop(id)) {
+              if (schedulerDone.load(std::memory_order_acquire)) {
+                return;
+              }
+              std::this_thread::yield();
+              continue;
+            }
+            uint64_t slot = InstanceSlot(id);
+            int64_t begin = NowNs();
+  )";
+  if (metrics) {
+    out << R"(
+            int32_t hardware = (int32_t)operatorHardware[instanceOp[slot]];
+            LocalMetrics().hardwareWait[hardware].Record(begin - instanceReadyTime[slot]);
+            LocalMetrics().hardwareDepth[hardware].Record(
+                hardwareReadyCnt[hardware].fetch_sub(1, std::memory_order_relaxed) - 1);
+    )";
+  }
+  out << R"(
+            operatorFunc[instanceOp[slot]]();
+            int64_t end = NowNs();
+            theoreticalTime[deviceId] += (end - begin) / 1e9;
+  )";
+  if (!tracePath.empty()) {
+    out << R"(
+            LocalTraceBuffer().Next() = {
+                id, instanceOp[slot], instanceFlow[slot],
+                (int32_t)operatorHardware[instanceOp[slot]], deviceId,
+                instanceReadyTime[slot], begin, end};
+    )";
+  }
+  if (metrics) {
+    out << "\t    InvocationDone(instanceInvocation[slot]);\n";
+  }
+  out << R"(
+            retireInstance(id);
           }
         }
   )";
-
-  return ret;
+  for (auto *expr : unit->hardware->exprs) {
+    out.Format("\tvoid %sExecute(int32_t deviceId) {\n"
+               "\t    HardwareExecute(Hardware_%s_Queue, "
+               "%s_TheoreticalTime, deviceId);\n"
+               "\t}\n",
+               expr->hardwareName->name.c_str(),
+               expr->hardwareName->name.c_str(),
+               expr->hardwareName->name.c_str());
+  }
 }
 
-std::string SIMIRBuilder::EmitGreedyScheduler(SIMTranslationUnit *unit) {
-  std::string ret = R"(
-        void GreedyScheduler(std::vector<uint64_t> &instanceHeader) {
-          std::vector<uint64_t> tmpCPUQueue, tmpNPUQueue, tmpGPUQueue;
-          for (auto id : instanceHeader) {
-            auto curInstanceType = operatorToHardwareTime.at(instanceToOperator.at(id)).first;
-
+/*
+  Device pool: a fixed set of host workers, sized to the host cores, drives
+  every logical device. Device d belongs to worker d % workerCnt, so its
+  state needs no synchronization. An operator is modeled by its deadline
+  instead of busy-waiting on a host thread: a worker starts an instance on
+  an idle device, keeps polling its other devices and retires the instance
+  once the deadline passed. Ready queues are shared per hardware class, so
+  whichever worker has an idle device of that class takes the next instance.
+  A worker with nothing to retire or start parks on workerParking until its
+  earliest deadline or until the scheduler pushes new work.
+*/
+void SIMIRBuilder::EmitDevicePoolFunc(SIMTranslationUnit *unit) {
+  out << R"(
+        struct LogicalDevice {
+          int32_t hardware;
+          int32_t deviceId;
+          bool busy;
+          uint64_t id;
+          int64_t beginNs, deadlineNs;
+        };
+        LogicalDevice logicalDevice[] = {
   )";
+  for (auto *expr : unit->hardware->exprs) {
+    for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
+      out.Format("\t\t{(int32_t)Hardware::%s, %d},\n",
+                 expr->hardwareName->name.c_str(), deviceId);
+    }
+  }
+  out << "\t};\n";
+  out << R"(
+        constexpr int32_t kLogicalDeviceCnt =
+            sizeof(logicalDevice) / sizeof(logicalDevice[0]);
 
-  ret += GenTmpQueuePushCall(unit, "id");
-
-  ret += R"(
-            aliveInstanceId.at(id) = 1;
+        // sleeps until shortly before deadline or until a hardware queue got
+        // work after `generation`; the rest of the way to deadline is spun
+        void ParkDeviceWorker(uint64_t generation, int64_t deadline) {
+          int64_t wakeNs = deadline == INT64_MAX ? INT64_MAX : deadline - sleepSlackNs;
+          if (wakeNs <= NowNs()) {
+            return;
           }
+          workerParking.Park(generation, wakeNs);
+        }
 
-          int headerId = 0;
-          while (headerId < instanceHeader.size()) {
-            auto curType = operatorToHardwareTime
-                              .at(instanceToOperator.at(instanceHeader[headerId]))
-                              .first;
-            if (hardwareCnt.at(curType) > 1) {
-              headerId++;
-              continue;
-            }
-            for (auto successorId : instancePostId[instanceHeader[headerId]]) {
-              bool allPreIdSameType = true;
-              for (auto preId : instancePreId.at(successorId)) {
-                if (aliveInstanceId.count(preId) != 0) {
-                  if (operatorToHardwareTime.at(instanceToOperator.at(preId)).first !=
-                      curType) {
-                    allPreIdSameType = false;
-                    break;
-                  }
+        void DeviceWorker(int32_t workerId, int32_t workerCnt) {
+          while (true) {
+            // read before the queues are polled, so no push is missed
+            uint64_t generation = workerParking.generation.load();
+            bool allIdle = true, progress = false;
+            int64_t nextDeadline = INT64_MAX;
+            int64_t now = NowNs();
+            for (int32_t d = workerId; d < kLogicalDeviceCnt; d += workerCnt) {
+              LogicalDevice &device = logicalDevice[d];
+              if (device.busy) {
+                if (now < device.deadlineNs) {
+                  allIdle = false;
+                  nextDeadline = std::min(nextDeadline, device.deadlineNs);
+                  continue;
                 }
+                progress = true;
+                hardwareTheoreticalTime[device.hardware][device.deviceId] +=
+                    (now - device.beginNs) / 1e9;
+  )";
+  if (!tracePath.empty()) {
+    out << R"(
+                uint64_t slot = InstanceSlot(device.id);
+                LocalTraceBuffer().Next() = {
+                    device.id, instanceOp[slot], instanceFlow[slot],
+                    device.hardware, device.deviceId, instanceReadyTime[slot],
+                    device.beginNs, now};
+    )";
+  }
+  if (metrics) {
+    out << "\t\tInvocationDone(instanceInvocation[InstanceSlot(device.id)]);\n";
+  }
+  out << R"(
+                device.busy = false;
+                retireInstance(device.id);
               }
-              if (allPreIdSameType) {
-                instanceHeader.emplace_back(successorId);
-                aliveInstanceId.at(successorId) = 1;
-                auto curInstanceType =
-                    operatorToHardwareTime.at(instanceToOperator.at(successorId)).first;
-
+              if (hardwareQueue[device.hardware]->pop(device.id)) {
+                device.busy = true;
+                device.beginNs = now;
+                device.deadlineNs =
+                    now + operatorTime[instanceOp[InstanceSlot(device.id)]];
+                allIdle = false;
+                progress = true;
+                nextDeadline = std::min(nextDeadline, device.deadlineNs);
   )";
-  ret += GenTmpQueuePushCall(unit, "successorId");
-  ret += R"(
+  if (metrics) {
+    out << R"(
+                LocalMetrics().hardwareWait[device.hardware].Record(
+                    now - instanceReadyTime[InstanceSlot(device.id)]);
+                LocalMetrics().hardwareDepth[device.hardware].Record(
+                    hardwareReadyCnt[device.hardware].fetch_sub(
+                        1, std::memory_order_relaxed) - 1);
+    )";
+  }
+  out << R"(
               }
             }
-            headerId++;
+            if (progress) {
+              continue;
+            }
+            if (allIdle && schedulerDone.load(std::memory_order_acquire)) {
+              return;
+            }
+            ParkDeviceWorker(generation, nextDeadline);
           }
+        }
 
+        int32_t DeviceWorkerCnt() {
+          int32_t cnt = std::thread::hardware_concurrency();
+          return std::max(1, std::min(cnt, kLogicalDeviceCnt));
+        }
   )";
+}
 
-  for (int i = 0; i < unit->hardware->exprs.size(); i++) {
-    std::string templateStr = R"(
-          for (auto id : tmp%sQueue) {
-            Hardware_%s_Queue.push(id);
+void SIMIRBuilder::EmitInstanceExecuteService(SIMTranslationUnit *unit) {
+  out << R"(
+        void InstanceExecuteService() {
+          std::vector<uint64_t> instanceHeader;
+          uint64_t id;
+          while (true) {
+            uint64_t generation = serviceParking.generation.load();
+            instanceHeader.clear();
+            while (readyInstanceQueue.pop(id)) {
+              instanceHeader.emplace_back(id);
+            }
+            if (!instanceHeader.empty()) {
+              scheduler->Schedule(instanceHeader);
+              continue;
+            }
+            scheduler->Dispatch();
+            if (simuDone.load(std::memory_order_acquire) &&
+                retiredInstanceCnt.load(std::memory_order_acquire) == topInstanceId) {
+              return;
+            }
+            serviceParking.Park(generation, INT64_MAX);
           }
-    )";
-    ret += StringFormat(templateStr.c_str(),
-                        unit->hardware->exprs[i]->hardwareName->name.c_str(),
-                        unit->hardware->exprs[i]->hardwareName->name.c_str());
-  }
-
-  ret += "\t}\n";
-  return ret;
+        }
+  )";
 }
 
-std::string SIMIRBuilder::EmitMainFunc(SIMTranslationUnit *unit) {
-  std::string ret = R"(
+void SIMIRBuilder::EmitMainFunc(SIMTranslationUnit *unit) {
+  out << R"(
         int main() {
+            CalibrateSleep();
+            int64_t initTime = NowNs();
+   )";
+  if (!tracePath.empty()) {
+    out << "\t    traceEpoch = initTime;\n";
+  }
+  out << R"(
             std::thread simuThread(simu);
             std::thread instanceExec(InstanceExecuteService);
    )";
-  for (auto *expr : unit->hardware->exprs) {
-    for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
-      ret += StringFormat("\t    std::thread %sThread_%d(%sExecute, %d);\n",
-                          expr->hardwareName->name.c_str(), deviceId,
-                          expr->hardwareName->name.c_str(), deviceId);
+  if (devicePool) {
+    out << R"(
+            std::vector<std::thread> deviceWorkers;
+            int32_t workerCnt = DeviceWorkerCnt();
+            for (int32_t workerId = 0; workerId < workerCnt; workerId++) {
+              deviceWorkers.emplace_back(DeviceWorker, workerId, workerCnt);
+            }
+    )";
+  } else {
+    for (auto *expr : unit->hardware->exprs) {
+      for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
+        out.Format("\t    std::thread %sThread_%d(%sExecute, %d);\n",
+                   expr->hardwareName->name.c_str(), deviceId,
+                   expr->hardwareName->name.c_str(), deviceId);
+      }
     }
   }
-  ret += R"(
-
-            gettimeofday(&initTime, NULL);
+  out << R"(
 
             simuThread.join();
             simuDone = 1;
+            serviceParking.Wake();
             instanceExec.join();
             schedulerDone = 1;
+            WakeDeviceWorkers();
     )";
-  for (auto *expr : unit->hardware->exprs) {
-    for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
-      ret += StringFormat("\t    %sThread_%d.join();\n",
-                          expr->hardwareName->name.c_str(), deviceId);
+  if (devicePool) {
+    out << R"(
+            for (auto &worker : deviceWorkers) {
+              worker.join();
+            }
+    )";
+  } else {
+    for (auto *expr : unit->hardware->exprs) {
+      for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
+        out.Format("\t    %sThread_%d.join();\n",
+                   expr->hardwareName->name.c_str(), deviceId);
+      }
     }
   }
-  ret += "\t    gettimeofday(&endTime, NULL);\n";
-  ret += R"(
-            double totalTime = ((endTime.tv_sec * 1000000ULL + endTime.tv_usec) -
-                          (initTime.tv_sec * 1000000ULL + initTime.tv_usec)) /
-                          (double)1000000;)";
-  ret += R"(
-            printf("\n\nHARDWARE\tBUSY_TIME\tIDLE_TIME\tUSAGE\n\n");
-  )";
-  for (auto *expr : unit->hardware->exprs) {
-    for (int32_t deviceId = 0; deviceId < expr->hardwareCnt; deviceId++) {
-      ret += R"(
-            printf("%s\t\t%.3lf\t\t%.3lf\t\t%.1lf%%\n", )";
-      ret += StringFormat(
-          R"("%s_%d", %s_TheoreticalTime[%d], totalTime - %s_TheoreticalTime[%d],
-                          %s_TheoreticalTime[%d] * 100 / totalTime);
-      )",
-          expr->hardwareName->name.c_str(), deviceId,
-          expr->hardwareName->name.c_str(), deviceId,
-          expr->hardwareName->name.c_str(), deviceId,
-          expr->hardwareName->name.c_str(), deviceId);
-    }
+  out << R"(
+            double totalTime = (NowNs() - initTime) / 1e9;)";
+  if (!tracePath.empty()) {
+    out << "\n\t    WriteTrace();";
   }
-  ret += R"(
+  GenUsageTablePrintCall(out, unit);
+  out << R"(
             std::cout << std::endl;
             std::cout << "Total : " << totalTime << " seconds" << std::endl;
-        })";
-  return ret;
+            std::cout << "Window : " << kInstanceWindow << " instances, "
+                      << producerStallCnt << " producer stalls, "
+                      << producerStallTime << " seconds stalled" << std::endl;)";
+  if (metrics) {
+    out << "\n\t    ReportMetrics();";
+  }
+  out << "\n\t}";
+}
+
+/*
+  Discrete-event scheduler: every registered instance becomes a release event
+  at the virtual time simu issued it. An instance is ready once it is released
+  and all of its predecessors completed; ready instances of each hardware are
+  dispatched to the lowest numbered idle device, which schedules a
+  completion event `time` ns later. ReadyQueue pops in the order instances
+  became ready, or under --scheduler=cp the highest rank first. Events are
+  ordered by (time, seq), so the result does not depend on the host.
+*/
+void SIMIRBuilder::EmitDiscreteEventScheduler(SIMTranslationUnit *unit) {
+  if (scheduler == SIMSchedulerPolicy::CriticalPath) {
+    out << R"(
+        struct ReadyQueue {
+          // (rank, -ready order, id)
+          std::priority_queue<std::tuple<uint64_t, int64_t, uint64_t>> heap;
+          int64_t readyCnt = 0;
+          void push(uint64_t id) { heap.emplace(instanceRank[id], -readyCnt++, id); }
+          bool empty() const { return heap.empty(); }
+          size_t size() const { return heap.size(); }
+          uint64_t front() const { return std::get<2>(heap.top()); }
+          void pop() { heap.pop(); }
+        };
+    )";
+  } else {
+    out << "\n\tusing ReadyQueue = std::queue<uint64_t>;\n";
+  }
+  out << R"(
+        struct SimEvent {
+          uint64_t time;
+          uint64_t seq;
+          uint64_t id;
+          int32_t device; // -1: release event
+          bool operator>(const SimEvent &other) const {
+            return time != other.time ? time > other.time : seq > other.seq;
+          }
+        };
+        uint64_t makespan;
+
+        void DiscreteEventScheduler() {
+          std::priority_queue<SimEvent, std::vector<SimEvent>, std::greater<SimEvent>> events;
+          uint64_t instanceCnt = topInstanceId + 1;
+          // successors of id: instancePostId[instancePostOffset[id], instancePostOffset[id + 1])
+          std::vector<uint64_t> instancePostOffset(instanceCnt + 1, 0);
+          std::vector<uint64_t> instancePostId(instancePreId.size());
+          for (auto preId : instancePreId) {
+            instancePostOffset[preId + 1]++;
+          }
+          for (uint64_t id = 0; id < instanceCnt; id++) {
+            instancePostOffset[id + 1] += instancePostOffset[id];
+          }
+          std::vector<uint64_t> postFill(instancePostOffset.begin(), instancePostOffset.end() - 1);
+          std::vector<uint32_t> remainingPreCnt(instanceCnt);
+          for (uint64_t id = 1; id < instanceCnt; id++) {
+            remainingPreCnt[id] = instancePreOffset[id + 1] - instancePreOffset[id];
+            for (uint64_t i = instancePreOffset[id]; i < instancePreOffset[id + 1]; i++) {
+              instancePostId[postFill[instancePreId[i]]++] = id;
+            }
+          }
+          std::vector<bool> released(instanceCnt, false);
+  )";
+  if (!tracePath.empty() || metrics) {
+    out << "\t  std::vector<uint64_t> readyTime(instanceCnt);\n";
+  }
+  if (metrics) {
+    out << R"(
+          // instances of every flow call not completed yet
+          std::vector<uint64_t> invocationPendingCnt(invocationFlow.size());
+          for (uint64_t id = 1; id < instanceCnt; id++) {
+            invocationPendingCnt[instanceInvocation[id]]++;
+          }
+          Metrics &metrics = LocalMetrics();
+    )";
+  }
+  out << R"(
+          std::vector<ReadyQueue> readyQueue(hardwareCnt.size());
+          std::vector<std::vector<bool>> deviceBusy(hardwareCnt.size());
+          uint64_t seq = 0;
+          for (auto &[hardware, cnt] : hardwareCnt) {
+            deviceBusy[(int)hardware].assign(cnt, false);
+          }
+          for (uint64_t id = 1; id < instanceCnt; id++) {
+            events.push({instanceReleaseTime[id], seq++, id, -1});
+          }
+          // hardware that got a ready instance or a free device this step
+          std::vector<int> touched;
+          std::vector<bool> isTouched(hardwareCnt.size(), false);
+          auto Touch = [&](int hardware) {
+            if (!isTouched[hardware]) {
+              isTouched[hardware] = true;
+              touched.push_back(hardware);
+            }
+          };
+
+          uint64_t now = 0;
+          while (!events.empty()) {
+            now = events.top().time;
+            while (!events.empty() && events.top().time == now) {
+              SimEvent event = events.top();
+              events.pop();
+              auto curInstanceType = operatorHardware[instanceToOperator[event.id]];
+              if (event.device < 0) {
+                released[event.id] = true;
+                if (remainingPreCnt[event.id] == 0) {
+                  readyQueue[(int)curInstanceType].push(event.id);
+                  Touch((int)curInstanceType);
+  )";
+  if (!tracePath.empty() || metrics) {
+    out << "\t\t  readyTime[event.id] = now;\n";
+  }
+  out << R"(
+                }
+                continue;
+              }
+              deviceBusy[(int)curInstanceType][event.device] = false;
+              Touch((int)curInstanceType);
+  )";
+  if (metrics) {
+    out << R"(
+              uint64_t invocation = instanceInvocation[event.id];
+              if (--invocationPendingCnt[invocation] == 0) {
+                metrics.flowLatency[invocationFlow[invocation]].Record(
+                    now - invocationTime[invocation]);
+              }
+    )";
+  }
+  out << R"(
+              for (uint64_t i = instancePostOffset[event.id]; i < instancePostOffset[event.id + 1]; i++) {
+                uint64_t successorId = instancePostId[i];
+                if (--remainingPreCnt[successorId] == 0 && released[successorId]) {
+                  int successorHardware =
+                      (int)operatorHardware[instanceToOperator[successorId]];
+                  readyQueue[successorHardware].push(successorId);
+                  Touch(successorHardware);
+  )";
+  if (!tracePath.empty() || metrics) {
+    out << "\t\t  readyTime[successorId] = now;\n";
+  }
+  out << R"(
+                }
+              }
+            }
+
+            std::sort(touched.begin(), touched.end());
+            for (int hardware : touched) {
+              isTouched[hardware] = false;
+              auto &queue = readyQueue[hardware];
+              auto &devices = deviceBusy[hardware];
+              for (int32_t device = 0; device < devices.size() && !queue.empty(); device++) {
+                if (devices[device]) {
+                  continue;
+                }
+                uint64_t id = queue.front();
+                queue.pop();
+                int64_t time = operatorTime[instanceToOperator[id]];
+                devices[device] = true;
+                hardwareTheoreticalTime[hardware][device] += time / 1e9;
+                events.push({now + time, seq++, id, device});
+  )";
+  if (metrics) {
+    out << R"(
+                metrics.hardwareWait[hardware].Record(now - readyTime[id]);
+                metrics.hardwareDepth[hardware].Record(queue.size());
+    )";
+  }
+  if (!tracePath.empty()) {
+    out << R"(
+                LocalTraceBuffer().Next() = {
+                    id, instanceToOperator[id], instanceFlow[id], hardware, device,
+                    (int64_t)readyTime[id], (int64_t)now, (int64_t)(now + time)};
+    )";
+  }
+  out << R"(
+              }
+            }
+            touched.clear();
+          }
+          makespan = std::max(now, virtualNow);
+        }
+  )";
+}
+
+void SIMIRBuilder::EmitDiscreteEventMainFunc(SIMTranslationUnit *unit) {
+  out << R"(
+        int main() {
+            simu();
+            DiscreteEventScheduler();
+            double totalTime = makespan / 1e9;)";
+  if (!tracePath.empty()) {
+    out << "\n\t    WriteTrace();";
+  }
+  GenUsageTablePrintCall(out, unit);
+  out << R"(
+            std::cout << std::endl;
+            std::cout << "Total : " << totalTime << " seconds" << std::endl;)";
+  if (metrics) {
+    out << "\n\t    ReportMetrics();";
+  }
+  out << "\n\t}";
 }
 
 } // namespace XPUSchedulerSimulator
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include "SimAST2LLVM.h"
+
+#include <stdexcept>
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace XPUSchedulerSimulator {
+
+/*
+  Runtime entry points the generated code calls, resolved by the JIT to the
+  addresses below. `engine` is the SIMEngine passed to simu.
+*/
+static uint64_t RuntimeRegisterInstance(void *engine, int32_t op,
+                                        const uint64_t *preRanges,
+                                        uint64_t rangeCnt, uint64_t rank) {
+  return static_cast<SIMEngine *>(engine)->RegisterInstanceRanges(
+      op, preRanges, rangeCnt, rank);
+}
+
+static uint64_t RuntimeInstanceCnt(void *engine) {
+  return static_cast<SIMEngine *>(engine)->InstanceCnt();
+}
+
+static void RuntimeSleep(void *engine, int64_t ns) {
+  static_cast<SIMEngine *>(engine)->Sleep(ns);
+}
+
+static void RuntimeBeginFlow(void *engine, int32_t flow) {
+  static_cast<SIMEngine *>(engine)->BeginFlow(flow);
+}
+
+void SIMLLVMBuilder::AST2LLVMIR(SIMTranslationUnit *unit) {
+  graph = LowerTaskGraph(unit, jobs);
+  context = std::make_unique<llvm::LLVMContext>();
+  module = std::make_unique<llvm::Module>("arcticflow", *context);
+
+  EmitRuntimeDecl();
+  llvm::Type *int64Ty = llvm::Type::getInt64Ty(*context);
+  llvm::FunctionType *flowTy = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(*context),
+      {llvm::Type::getInt8PtrTy(*context), int64Ty->getPointerTo(), int64Ty,
+       int64Ty},
+      false);
+  flowFuncs.clear();
+  for (auto &flow : graph.flows) {
+    flowFuncs.emplace_back(llvm::Function::Create(
+        flowTy, llvm::Function::InternalLinkage, "flow." + flow.name,
+        module.get()));
+  }
+  for (int32_t flow = 0; flow < graph.flows.size(); flow++) {
+    EmitFlowFunc(flow);
+  }
+  EmitSimuFunc();
+
+  std::string err;
+  llvm::raw_string_ostream errStream(err);
+  if (llvm::verifyModule(*module, &errStream)) {
+    throw std::logic_error("Invalid LLVM module: " + errStream.str());
+  }
+}
+
+void SIMLLVMBuilder::EmitRuntimeDecl() {
+  llvm::Type *voidTy = llvm::Type::getVoidTy(*context);
+  llvm::Type *enginePtrTy = llvm::Type::getInt8PtrTy(*context);
+  llvm::Type *int32Ty = llvm::Type::getInt32Ty(*context);
+  llvm::Type *int64Ty = llvm::Type::getInt64Ty(*context);
+  registerInstanceFunc = module->getOrInsertFunction(
+      "arcticflow_register_instance",
+      llvm::FunctionType::get(
+          int64Ty,
+          {enginePtrTy, int32Ty, int64Ty->getPointerTo(), int64Ty, int64Ty},
+          false));
+  instanceCntFunc = module->getOrInsertFunction(
+      "arcticflow_instance_cnt",
+      llvm::FunctionType::get(int64Ty, {enginePtrTy}, false));
+  sleepFunc = module->getOrInsertFunction(
+      "arcticflow_sleep",
+      llvm::FunctionType::get(voidTy, {enginePtrTy, int64Ty}, false));
+  if (trace || metrics) {
+    beginFlowFunc = module->getOrInsertFunction(
+        "arcticflow_begin_flow",
+        llvm::FunctionType::get(voidTy, {enginePtrTy, int32Ty}, false));
+  }
+}
+
+/*
+  Emits `body` `cnt` times, as a counted loop when cnt > 1. body may add
+  blocks of its own, the loop latch goes after whatever block it ends in.
+*/
+void SIMLLVMBuilder::EmitRepeat(llvm::IRBuilder<> &builder, int32_t cnt,
+                                const std::function<void()> &body) {
+  if (cnt <= 0) {
+    return;
+  }
+  if (cnt == 1) {
+    body();
+    return;
+  }
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+  llvm::BasicBlock *preheader = builder.GetInsertBlock();
+  llvm::BasicBlock *loop = llvm::BasicBlock::Create(*context, "loop", func);
+  llvm::BasicBlock *exit = llvm::BasicBlock::Create(*context, "loop.end", func);
+  builder.CreateBr(loop);
+
+  builder.SetInsertPoint(loop);
+  llvm::PHINode *loopI = builder.CreatePHI(builder.getInt32Ty(), 2, "i");
+  loopI->addIncoming(builder.getInt32(0), preheader);
+  body();
+  llvm::Value *next = builder.CreateAdd(loopI, builder.getInt32(1));
+  loopI->addIncoming(next, builder.GetInsertBlock());
+  builder.CreateCondBr(builder.CreateICmpSLT(next, builder.getInt32(cnt)),
+                       loop, exit);
+  builder.SetInsertPoint(exit);
+}
+
+/*
+  Nodes are emitted in the order LowerTaskGraph sorted them. Each node
+  records the id range it registered; a node with predecessors gets them as
+  a stack array of (begin, end) pairs, a header node forwards the flow's own
+  preRanges. Ranks are offset by the tailRank argument like in
+  SIMEngine::Instantiate.
+*/
+void SIMLLVMBuilder::EmitFlowFunc(int32_t flow) {
+  llvm::Function *func = flowFuncs[flow];
+  auto argIt = func->arg_begin();
+  llvm::Value *engine = &*argIt++;
+  llvm::Value *preRanges = &*argIt++;
+  llvm::Value *rangeCnt = &*argIt++;
+  llvm::Value *tailRank = &*argIt;
+
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(*context, "entry", func);
+  llvm::IRBuilder<> builder(entry);
+  llvm::IRBuilder<> allocaBuilder(entry);
+
+  auto &nodes = graph.flows[flow].nodes;
+  std::vector<llvm::Value *> nodeBegin(nodes.size()), nodeEnd(nodes.size());
+  for (int32_t i = 0; i < nodes.size(); i++) {
+    auto &node = nodes[i];
+    llvm::Value *curPre = preRanges, *curCnt = rangeCnt;
+    if (!node.preNodes.empty()) {
+      allocaBuilder.SetInsertPoint(entry, entry->getFirstInsertionPt());
+      llvm::Value *buf = allocaBuilder.CreateAlloca(
+          builder.getInt64Ty(), builder.getInt32(2 * node.preNodes.size()),
+          "pre." + std::to_string(i));
+      for (int32_t k = 0; k < node.preNodes.size(); k++) {
+        builder.CreateStore(
+            nodeBegin[node.preNodes[k]],
+            builder.CreateConstGEP1_32(builder.getInt64Ty(), buf, 2 * k));
+        builder.CreateStore(
+            nodeEnd[node.preNodes[k]],
+            builder.CreateConstGEP1_32(builder.getInt64Ty(), buf, 2 * k + 1));
+      }
+      curPre = buf;
+      curCnt = builder.getInt64(node.preNodes.size());
+    }
+
+    if (node.op >= 0) {
+      nodeBegin[i] = builder.CreateCall(
+          registerInstanceFunc,
+          {engine, builder.getInt32(node.op), curPre, curCnt,
+           builder.CreateAdd(tailRank, builder.getInt64(node.rank))});
+      nodeEnd[i] = builder.CreateAdd(nodeBegin[i], builder.getInt64(1));
+    } else {
+      nodeBegin[i] = builder.CreateCall(instanceCntFunc, {engine});
+      llvm::Value *calleeTailRank = builder.CreateAdd(
+          tailRank, builder.getInt64(node.rank -
+                                     graph.flows[node.flow].criticalPath));
+      EmitRepeat(builder, node.repeat, [&]() {
+        builder.CreateCall(flowFuncs[node.flow],
+                           {engine, curPre, curCnt, calleeTailRank});
+      });
+      nodeEnd[i] = builder.CreateCall(instanceCntFunc, {engine});
+    }
+  }
+  builder.CreateRetVoid();
+}
+
+void SIMLLVMBuilder::EmitSimuSteps(llvm::IRBuilder<> &builder,
+                                   llvm::Value *engine, int32_t begin,
+                                   int32_t end) {
+  llvm::Value *noPre =
+      llvm::ConstantPointerNull::get(builder.getInt64Ty()->getPointerTo());
+  for (int32_t i = begin; i < end; i++) {
+    auto &step = graph.simu[i];
+    if (step.kind == SIMTaskGraph::SimuStep::Call) {
+      if (trace || metrics) {
+        builder.CreateCall(beginFlowFunc,
+                           {engine, builder.getInt32(step.arg)});
+      }
+      builder.CreateCall(flowFuncs[step.arg], {engine, noPre,
+                                               builder.getInt64(0),
+                                               builder.getInt64(0)});
+    } else if (step.kind == SIMTaskGraph::SimuStep::Sleep) {
+      builder.CreateCall(sleepFunc, {engine, builder.getInt64(step.arg)});
+    } else {
+      EmitRepeat(builder, step.arg, [&]() {
+        EmitSimuSteps(builder, engine, i + 1, step.bodyEnd);
+      });
+      i = step.bodyEnd - 1;
+    }
+  }
+}
+
+void SIMLLVMBuilder::EmitSimuFunc() {
+  llvm::Function *func = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(*context),
+                              {llvm::Type::getInt8PtrTy(*context)}, false),
+      llvm::Function::ExternalLinkage, "simu", module.get());
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*context, "entry", func));
+  EmitSimuSteps(builder, &*func->arg_begin(), 0, graph.simu.size());
+  builder.CreateRetVoid();
+}
+
+void SIMLLVMBuilder::Optimize() {
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PassBuilder passBuilder;
+  passBuilder.registerModuleAnalyses(mam);
+  passBuilder.registerCGSCCAnalyses(cgam);
+  passBuilder.registerFunctionAnalyses(fam);
+  passBuilder.registerLoopAnalyses(lam);
+  passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
+  passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2)
+      .run(*module, mam);
+}
+
+std::string SIMLLVMBuilder::dump() {
+  std::string ret;
+  llvm::raw_string_ostream stream(ret);
+  module->print(stream, nullptr);
+  return stream.str();
+}
+
+/*
+  The module and its context move into the JIT, so this can only be called
+  once per AST2LLVMIR.
+*/
+SIMEngineResult SIMLLVMBuilder::JITRun() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) {
+    throw std::runtime_error("Cannot create JIT: " +
+                             llvm::toString(jit.takeError()));
+  }
+  auto Symbol = [](auto *func) {
+    return llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(func),
+                                    llvm::JITSymbolFlags::Exported);
+  };
+  llvm::orc::SymbolMap runtimeSymbols;
+  runtimeSymbols[(*jit)->mangleAndIntern("arcticflow_register_instance")] =
+      Symbol(&RuntimeRegisterInstance);
+  runtimeSymbols[(*jit)->mangleAndIntern("arcticflow_instance_cnt")] =
+      Symbol(&RuntimeInstanceCnt);
+  runtimeSymbols[(*jit)->mangleAndIntern("arcticflow_sleep")] =
+      Symbol(&RuntimeSleep);
+  runtimeSymbols[(*jit)->mangleAndIntern("arcticflow_begin_flow")] =
+      Symbol(&RuntimeBeginFlow);
+  if (auto err = (*jit)->getMainJITDylib().define(
+          llvm::orc::absoluteSymbols(std::move(runtimeSymbols)))) {
+    throw std::runtime_error(llvm::toString(std::move(err)));
+  }
+  if (auto err = (*jit)->addIRModule(
+          llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+    throw std::runtime_error(llvm::toString(std::move(err)));
+  }
+  auto simuSymbol = (*jit)->lookup("simu");
+  if (!simuSymbol) {
+    throw std::runtime_error(llvm::toString(simuSymbol.takeError()));
+  }
+  auto *simu = llvm::jitTargetAddressToFunction<void (*)(void *)>(
+      simuSymbol->getAddress());
+
+  SIMEngine engine(graph);
+  engine.policy = policy;
+  engine.trace = trace;
+  engine.metrics = metrics;
+  engine.Reset();
+  simu(&engine);
+  return engine.Finish();
+}
+
+} // namespace XPUSchedulerSimulator
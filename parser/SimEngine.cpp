@@ -0,0 +1,987 @@
+#include "SimEngine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+namespace XPUSchedulerSimulator {
+
+int32_t SIMTaskGraph::FindFlow(const std::string &name) const {
+  for (int32_t i = 0; i < flows.size(); i++) {
+    if (flows[i].name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int32_t SIMTaskGraph::FindOperator(const std::string &name) const {
+  for (int32_t i = 0; i < operators.size(); i++) {
+    if (operators[i].name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  Callees are ranked first. The call graph is walked with an explicit stack
+  of (flow, next node), so deep call chains cost no native stack, and a flow
+  met again while it is still on the stack calls itself.
+*/
+void SIMTaskGraph::RankFlow(int32_t flow) {
+  if (flows[flow].ranked) {
+    return;
+  }
+  std::vector<bool> onStack(flows.size());
+  std::vector<std::pair<int32_t, int32_t>> stack;
+  onStack[flow] = true;
+  stack.emplace_back(flow, 0);
+  while (!stack.empty()) {
+    auto &[cur, nextNode] = stack.back();
+    auto &nodes = flows[cur].nodes;
+    if (nextNode < nodes.size()) {
+      int32_t callee = nodes[nextNode++].flow;
+      if (callee < 0 || flows[callee].ranked) {
+        continue;
+      }
+      if (onStack[callee]) {
+        throw std::logic_error("Flow " + flows[callee].name +
+                               " calls itself");
+      }
+      onStack[callee] = true;
+      stack.emplace_back(callee, 0);
+      continue;
+    }
+    RankNodes(cur);
+    onStack[cur] = false;
+    stack.pop_back();
+  }
+}
+
+void SIMTaskGraph::RankNodes(int32_t flow) {
+  auto &nodes = flows[flow].nodes;
+  std::vector<uint64_t> cost(nodes.size());
+  for (int32_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i].op >= 0) {
+      cost[i] = operators[nodes[i].op].time;
+    } else {
+      // foreach iterations share their predecessors and run side by side
+      cost[i] = flows[nodes[i].flow].criticalPath;
+    }
+    nodes[i].rank = 0;
+  }
+  // predecessors come first, so walking backwards sees successors first
+  uint64_t criticalPath = 0;
+  for (int32_t i = nodes.size() - 1; i >= 0; i--) {
+    nodes[i].rank += cost[i];
+    for (auto preNode : nodes[i].preNodes) {
+      nodes[preNode].rank = std::max(nodes[preNode].rank, nodes[i].rank);
+    }
+    criticalPath = std::max(criticalPath, nodes[i].rank);
+  }
+  flows[flow].criticalPath = criticalPath;
+  flows[flow].ranked = true;
+}
+
+SIMSchedulerPolicy ParseSchedulerPolicy(const std::string &name) {
+  if (name == "fifo") {
+    return SIMSchedulerPolicy::Fifo;
+  } else if (name == "cp") {
+    return SIMSchedulerPolicy::CriticalPath;
+  }
+  throw std::logic_error("Unknown scheduler " + name);
+}
+
+int32_t SIMJobCnt(int32_t jobs, int32_t cnt) {
+  if (jobs <= 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::max(1, std::min(jobs, cnt));
+}
+
+void SIMParallelFor(int32_t cnt, int32_t jobs,
+                    const std::function<void(int32_t, int32_t)> &body) {
+  int32_t workers = SIMJobCnt(jobs, cnt);
+  if (workers == 1) {
+    for (int32_t i = 0; i < cnt; i++) {
+      body(i, 0);
+    }
+    return;
+  }
+  std::atomic<int32_t> next{0};
+  std::atomic<bool> failed{false};
+  std::mutex errorMutex;
+  int32_t errorIndex = cnt;
+  std::exception_ptr error;
+  auto work = [&](int32_t worker) {
+    while (!failed.load(std::memory_order_relaxed)) {
+      int32_t i = next.fetch_add(1);
+      if (i >= cnt) {
+        return;
+      }
+      try {
+        body(i, worker);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (i < errorIndex) {
+          errorIndex = i;
+          error = std::current_exception();
+        }
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int32_t worker = 1; worker < workers; worker++) {
+    threads.emplace_back(work, worker);
+  }
+  work(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+struct SIMTaskGraphLowering {
+  SIMTaskGraph &graph;
+  // indexed by symbol id, -1 when the symbol does not name one
+  std::vector<int32_t> hardwareOfSymbol, opOfSymbol, flowOfSymbol;
+
+  explicit SIMTaskGraphLowering(SIMTaskGraph &graph, size_t symbolCnt)
+      : graph(graph), hardwareOfSymbol(symbolCnt, -1),
+        opOfSymbol(symbolCnt, -1), flowOfSymbol(symbolCnt, -1) {}
+
+  void LowerSimuBlock(SIMSimuBlock *block);
+};
+
+/*
+  One user flow block and the foreach bodies it expands to. Blocks only read
+  the shared symbol tables, so they are lowered in parallel and merged into
+  the graph afterwards.
+*/
+struct SIMFlowBlockLowering {
+  const SIMTaskGraphLowering &shared;
+  // [0] is the block itself, then its foreach bodies in the order a serial
+  // lowering would have appended them to the graph
+  std::vector<SIMTaskGraph::Flow> flows;
+  // (flow, node) of every foreach node, their Node::flow indexes `flows`
+  std::vector<std::pair<int32_t, int32_t>> foreachNodes;
+
+  // localOfSymbol: scratch of the calling worker, all -1 between calls
+  void LowerFlowBlock(int32_t flowId, SIMFlowBlock *block,
+                      std::vector<int32_t> &localOfSymbol);
+};
+
+/*
+  An operator or flow is one node per block however often it is named, a
+  foreach is a node of its own and its body becomes the flow
+  `<flow>_<exprId>FE<depth>`. Edges are collected as local node indices;
+  nodes are then placed by a DFS from the roots in name order, predecessors
+  first, which is the registration order every backend shares.
+*/
+void SIMFlowBlockLowering::LowerFlowBlock(
+    int32_t flowId, SIMFlowBlock *block, std::vector<int32_t> &localOfSymbol) {
+  std::string flowName = flows[flowId].name;
+  struct LocalNode {
+    // operator or flow, nullptr for a foreach
+    SIMSymbol *symbol;
+    SIMForeachExpression *foreachExpr;
+    std::string foreachName;
+    std::vector<int32_t> preNodes;
+
+    const std::string &name() const {
+      return symbol != nullptr ? symbol->name : foreachName;
+    }
+  };
+  std::vector<LocalNode> locals;
+
+  for (int32_t exprId = 0; exprId < block->exprs.size(); exprId++) {
+    auto &chain = block->exprs[exprId]->stages;
+    int32_t pre = -1;
+    for (int32_t depth = 0; depth < chain.size(); depth++) {
+      int32_t cur;
+      if (SIMFlowUnaryExpression *unaryExpr =
+              dynamic_cast<SIMFlowUnaryExpression *>(chain[depth])) {
+        cur = localOfSymbol[unaryExpr->opName->id];
+        if (cur < 0) {
+          cur = localOfSymbol[unaryExpr->opName->id] = locals.size();
+          locals.push_back({unaryExpr->opName, nullptr, {}, {}});
+        }
+      } else if (SIMForeachExpression *foreachExpr =
+                     dynamic_cast<SIMForeachExpression *>(chain[depth])) {
+        cur = locals.size();
+        locals.push_back(
+            {nullptr, foreachExpr,
+             StringFormat("%s_%dFE%d", flowName.c_str(), exprId, depth), {}});
+      } else {
+        throw std::logic_error("Unsupported FlowExpression!");
+      }
+      if (pre >= 0) {
+        locals[cur].preNodes.emplace_back(pre);
+      }
+      pre = cur;
+    }
+  }
+  for (auto &local : locals) {
+    if (local.symbol != nullptr) {
+      localOfSymbol[local.symbol->id] = -1;
+    }
+  }
+
+  std::vector<int32_t> roots(locals.size());
+  for (int32_t i = 0; i < roots.size(); i++) {
+    roots[i] = i;
+  }
+  std::sort(roots.begin(), roots.end(), [&](int32_t lhs, int32_t rhs) {
+    return locals[lhs].name() < locals[rhs].name();
+  });
+
+  /*
+    Iterative post-order DFS, a chain of any length is one path. A frame
+    whose predecessors are all placed is placed itself; reaching a node
+    that is still on the stack is a cycle.
+  */
+  enum : uint8_t { Unvisited, Visiting, Placed };
+  std::vector<uint8_t> state(locals.size(), Unvisited);
+  std::vector<int32_t> nodeOfLocal(locals.size(), -1);
+  std::vector<SIMTaskGraph::Node> nodes;
+  nodes.reserve(locals.size());
+  // local node, next predecessor to visit
+  std::vector<std::pair<int32_t, int32_t>> stack;
+  auto place = [&](int32_t local) {
+    SIMTaskGraph::Node node;
+    node.name = locals[local].name();
+    for (int32_t pre : locals[local].preNodes) {
+      node.preNodes.emplace_back(nodeOfLocal[pre]);
+    }
+    if (SIMSymbol *symbol = locals[local].symbol) {
+      if (shared.opOfSymbol[symbol->id] >= 0) {
+        node.op = shared.opOfSymbol[symbol->id];
+      } else if (shared.flowOfSymbol[symbol->id] >= 0) {
+        node.flow = shared.flowOfSymbol[symbol->id];
+      } else {
+        throw std::logic_error("Unknown operator or flow " + symbol->name +
+                               " in flow " + flowName);
+      }
+    } else {
+      SIMForeachExpression *foreachExpr = locals[local].foreachExpr;
+      int32_t foreachFlowId = flows.size();
+      flows.push_back({node.name, {}});
+      LowerFlowBlock(foreachFlowId,
+                     dynamic_cast<SIMFlowBlock *>(foreachExpr->loopBlock),
+                     localOfSymbol);
+      node.flow = foreachFlowId;
+      foreachNodes.emplace_back(flowId, nodes.size());
+      node.repeat = foreachExpr->loopCnt;
+    }
+    state[local] = Placed;
+    nodeOfLocal[local] = nodes.size();
+    nodes.emplace_back(std::move(node));
+  };
+  for (int32_t root : roots) {
+    if (state[root] != Unvisited) {
+      continue;
+    }
+    state[root] = Visiting;
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+      auto &[local, nextPre] = stack.back();
+      if (nextPre == locals[local].preNodes.size()) {
+        int32_t done = local;
+        stack.pop_back();
+        place(done);
+        continue;
+      }
+      int32_t pre = locals[local].preNodes[nextPre++];
+      if (state[pre] == Visiting) {
+        throw std::logic_error("Cyclic dependency on " + locals[pre].name() +
+                               " in flow " + flowName);
+      }
+      if (state[pre] == Unvisited) {
+        state[pre] = Visiting;
+        stack.emplace_back(pre, 0);
+      }
+    }
+  }
+  flows[flowId].nodes = std::move(nodes);
+}
+
+void SIMTaskGraphLowering::LowerSimuBlock(SIMSimuBlock *block) {
+  for (auto *expr : block->exprs) {
+    if (SIMCallExpression *callExpr = dynamic_cast<SIMCallExpression *>(expr)) {
+      if (callExpr->name == nullptr) {
+        continue;
+      }
+      if (callExpr->name->name == "sleep") {
+        graph.simu.push_back({SIMTaskGraph::SimuStep::Sleep, callExpr->arg0});
+      } else if (flowOfSymbol[callExpr->name->id] >= 0) {
+        graph.simu.push_back(
+            {SIMTaskGraph::SimuStep::Call, flowOfSymbol[callExpr->name->id]});
+      } else {
+        throw std::logic_error("simu calls unknown flow " +
+                               callExpr->name->name);
+      }
+    } else if (SIMForeachExpression *foreachExpr =
+                   dynamic_cast<SIMForeachExpression *>(expr)) {
+      int32_t loopStep = graph.simu.size();
+      graph.simu.push_back({SIMTaskGraph::SimuStep::Loop, foreachExpr->loopCnt});
+      LowerSimuBlock(dynamic_cast<SIMSimuBlock *>(foreachExpr->loopBlock));
+      graph.simu[loopStep].bodyEnd = graph.simu.size();
+    }
+  }
+}
+
+SIMTaskGraph LowerTaskGraph(SIMTranslationUnit *unit, int32_t jobs,
+                            const std::map<std::string, SIMFlowBlockStub> *stubs) {
+  if (unit->hardware == nullptr || unit->op == nullptr ||
+      unit->simu == nullptr) {
+    throw std::logic_error("hardware, operator and simu blocks are required");
+  }
+
+  SIMTaskGraph graph;
+  SIMTaskGraphLowering lowering(graph, unit->symbols.size());
+  for (auto *expr : unit->hardware->exprs) {
+    lowering.hardwareOfSymbol[expr->hardwareName->id] = graph.hardware.size();
+    graph.hardware.push_back({expr->hardwareName->name, expr->hardwareCnt});
+  }
+  for (auto *expr : unit->op->exprs) {
+    int32_t hardware = lowering.hardwareOfSymbol[expr->hardwareName->id];
+    if (hardware < 0) {
+      throw std::logic_error("Operator " + expr->opName->name +
+                             " uses unknown hardware " +
+                             expr->hardwareName->name);
+    }
+    lowering.opOfSymbol[expr->opName->id] = graph.operators.size();
+    graph.operators.push_back({expr->opName->name, hardware, expr->time});
+  }
+
+  // user flows take the first ids, in name order
+  std::vector<std::pair<SIMSymbol *, SIMFlowBlock *>> flowBlocks(
+      unit->flowBlocks.begin(), unit->flowBlocks.end());
+  std::sort(flowBlocks.begin(), flowBlocks.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return lhs.first->name < rhs.first->name;
+            });
+  for (auto &[sym, block] : flowBlocks) {
+    lowering.flowOfSymbol[sym->id] = graph.flows.size();
+    graph.flows.push_back({sym->name, {}});
+  }
+
+  std::vector<SIMFlowBlockLowering> blocks(flowBlocks.size(),
+                                           SIMFlowBlockLowering{lowering, {}, {}});
+  std::vector<std::vector<int32_t>> localOfSymbol(
+      SIMJobCnt(jobs, flowBlocks.size()),
+      std::vector<int32_t>(unit->symbols.size(), -1));
+  auto stubOf = [&](int32_t i) -> const SIMFlowBlockStub * {
+    if (stubs == nullptr) {
+      return nullptr;
+    }
+    auto it = stubs->find(flowBlocks[i].first->name);
+    return it == stubs->end() ? nullptr : &it->second;
+  };
+  SIMParallelFor(flowBlocks.size(), jobs, [&](int32_t i, int32_t worker) {
+    blocks[i].flows.push_back({flowBlocks[i].first->name, {}});
+    if (const SIMFlowBlockStub *stub = stubOf(i)) {
+      blocks[i].flows[0].criticalPath = stub->criticalPath;
+      blocks[i].flows[0].ranked = true;
+      for (auto &name : stub->foreachNames) {
+        blocks[i].flows.push_back({name, {}});
+        blocks[i].flows.back().ranked = true;
+      }
+      return;
+    }
+    blocks[i].LowerFlowBlock(0, flowBlocks[i].second, localOfSymbol[worker]);
+  });
+  // foreach bodies get the ids a serial lowering in name order hands out
+  for (int32_t i = 0; i < blocks.size(); i++) {
+    auto &flows = blocks[i].flows;
+    int32_t base = graph.flows.size() - 1;
+    auto &userFlow = graph.flows[i];
+    userFlow.criticalPath = flows[0].criticalPath;
+    userFlow.ranked = flows[0].ranked;
+    userFlow.foreachBegin = graph.flows.size();
+    userFlow.foreachEnd = graph.flows.size() + flows.size() - 1;
+    for (auto [flow, node] : blocks[i].foreachNodes) {
+      flows[flow].nodes[node].flow += base;
+    }
+    userFlow.nodes = std::move(flows[0].nodes);
+    for (int32_t flow = 1; flow < flows.size(); flow++) {
+      graph.flows.emplace_back(std::move(flows[flow]));
+    }
+  }
+  for (int32_t flow = 0; flow < graph.flows.size(); flow++) {
+    graph.RankFlow(flow);
+  }
+  lowering.LowerSimuBlock(unit->simu);
+  return graph;
+}
+
+std::string SIMEngineResult::dump(const SIMTaskGraph &graph) const {
+  // seconds to the nanosecond the clock runs at
+  double totalTime = makespan / 1e9;
+  std::string ret = "\n\nHARDWARE\tBUSY_TIME\tIDLE_TIME\tUSAGE\n\n";
+  for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+    for (int32_t device = 0; device < graph.hardware[hardware].cnt; device++) {
+      double busy = busyTime[hardware][device] / 1e9;
+      ret += StringFormat("%s_%d\t\t%.9lf\t\t%.9lf\t\t%.1lf%%\n",
+                          graph.hardware[hardware].name.c_str(), device, busy,
+                          totalTime - busy,
+                          totalTime > 0 ? busy * 100 / totalTime : 0.0);
+    }
+  }
+  ret += StringFormat("\nTotal : %g seconds\n", totalTime);
+  return ret;
+}
+
+// ns as microseconds, the unit of the format, without rounding
+static std::string TraceMicros(uint64_t ns) {
+  return StringFormat("%" PRIu64 ".%03" PRIu64, ns / 1000, ns % 1000);
+}
+
+/*
+  The emitted simulators write the same text (see EmitTraceFunc), so the
+  trace of --mode=run equals the one of the --mode=des simulator.
+*/
+void SIMEngineResult::WriteChromeTrace(const SIMTaskGraph &graph,
+                                       std::ostream &os) const {
+  os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  const char *separator = "\n";
+  for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+    const char *name = graph.hardware[hardware].name.c_str();
+    os << separator
+       << StringFormat("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                       "\"args\":{\"name\":\"%s\"}}",
+                       hardware + 1, name);
+    separator = ",\n";
+    for (int32_t device = 0; device < graph.hardware[hardware].cnt; device++) {
+      os << separator
+         << StringFormat("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                         "\"tid\":%d,\"args\":{\"name\":\"%s_%d\"}}",
+                         hardware + 1, device + 1, name, device);
+    }
+  }
+  for (auto &event : trace) {
+    os << separator
+       << StringFormat(
+              "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+              "\"ts\":%s,\"dur\":%s,\"args\":{\"id\":%" PRIu64
+              ",\"flow\":\"%s\",\"ready\":%s,\"wait\":%s}}",
+              graph.operators[event.op].name.c_str(), event.hardware + 1,
+              event.device + 1, TraceMicros(event.beginTime).c_str(),
+              TraceMicros(event.endTime - event.beginTime).c_str(), event.id,
+              event.flow >= 0 ? graph.flows[event.flow].name.c_str() : "",
+              TraceMicros(event.readyTime).c_str(),
+              TraceMicros(event.beginTime - event.readyTime).c_str());
+    separator = ",\n";
+  }
+  os << "\n]}\n";
+}
+
+void SIMHistogram::Record(uint64_t value) {
+  if (buckets.empty()) {
+    buckets.assign(kBucketCnt, 0);
+  }
+  int32_t index = value;
+  if (value >= (1 << kSubBits)) {
+    int32_t exponent = 63 - __builtin_clzll(value);
+    index = ((exponent - kSubBits + 1) << kSubBits) +
+            (value >> (exponent - kSubBits)) - (1 << kSubBits);
+  }
+  buckets[index]++;
+  count++;
+  max = std::max(max, value);
+}
+
+void SIMHistogram::Merge(const SIMHistogram &other) {
+  if (other.count == 0) {
+    return;
+  }
+  if (buckets.empty()) {
+    buckets.assign(kBucketCnt, 0);
+  }
+  for (int32_t index = 0; index < kBucketCnt; index++) {
+    buckets[index] += other.buckets[index];
+  }
+  count += other.count;
+  max = std::max(max, other.max);
+}
+
+uint64_t SIMHistogram::Quantile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count));
+  uint64_t seen = 0;
+  int32_t index = 0;
+  while ((seen += buckets[index]) < rank) {
+    index++;
+  }
+  if (index < (1 << kSubBits)) {
+    return index;
+  }
+  // the last value of the bucket
+  int32_t exponent = (index >> kSubBits) + kSubBits - 1;
+  uint64_t mantissa = (index & ((1 << kSubBits) - 1)) + (1 << kSubBits);
+  return std::min(((mantissa + 1) << (exponent - kSubBits)) - 1, max);
+}
+
+/*
+  Flows are listed by id and only if simu called them; the des simulator
+  prints the same text.
+*/
+std::string SIMEngineResult::MetricsReport(const SIMTaskGraph &graph) const {
+  std::string ret = "\nFLOW\t\tCALLS\t\tLATENCY_P50\tLATENCY_P99\t"
+                    "LATENCY_P999\tLATENCY_MAX\n\n";
+  for (int32_t flow = 0; flow < flowLatency.size(); flow++) {
+    auto &latency = flowLatency[flow];
+    if (latency.count == 0) {
+      continue;
+    }
+    ret += StringFormat("%s\t\t%" PRIu64 "\t\t%.9lf\t%.9lf\t%.9lf\t%.9lf\n",
+                        graph.flows[flow].name.c_str(), latency.count,
+                        latency.Quantile(0.5) / 1e9,
+                        latency.Quantile(0.99) / 1e9,
+                        latency.Quantile(0.999) / 1e9, latency.max / 1e9);
+  }
+  ret += "\nHARDWARE\tWAIT_P50\tWAIT_P99\tWAIT_P999\tWAIT_MAX\t"
+         "DEPTH_P50\tDEPTH_P99\tDEPTH_MAX\n\n";
+  for (int32_t hardware = 0; hardware < hardwareWait.size(); hardware++) {
+    auto &wait = hardwareWait[hardware];
+    auto &depth = hardwareDepth[hardware];
+    ret += StringFormat(
+        "%s\t\t%.9lf\t%.9lf\t%.9lf\t%.9lf\t%" PRIu64 "\t\t%" PRIu64
+        "\t\t%" PRIu64 "\n",
+        graph.hardware[hardware].name.c_str(), wait.Quantile(0.5) / 1e9,
+        wait.Quantile(0.99) / 1e9, wait.Quantile(0.999) / 1e9, wait.max / 1e9,
+        depth.Quantile(0.5), depth.Quantile(0.99), depth.max);
+  }
+  return ret;
+}
+
+static std::string MetricsJSON(const SIMHistogram &histogram) {
+  return StringFormat("{\"count\":%" PRIu64 ",\"p50\":%" PRIu64
+                      ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64
+                      ",\"max\":%" PRIu64 "}",
+                      histogram.count, histogram.Quantile(0.5),
+                      histogram.Quantile(0.99), histogram.Quantile(0.999),
+                      histogram.max);
+}
+
+// times in ns
+void SIMEngineResult::WriteMetricsJSON(const SIMTaskGraph &graph,
+                                       std::ostream &os) const {
+  os << "{\"flows\":[";
+  const char *separator = "\n";
+  for (int32_t flow = 0; flow < flowLatency.size(); flow++) {
+    if (flowLatency[flow].count == 0) {
+      continue;
+    }
+    os << separator << "{\"name\":\"" << graph.flows[flow].name
+       << "\",\"latency\":" << MetricsJSON(flowLatency[flow]) << "}";
+    separator = ",\n";
+  }
+  os << "\n],\"hardware\":[";
+  separator = "\n";
+  for (int32_t hardware = 0; hardware < hardwareWait.size(); hardware++) {
+    os << separator << "{\"name\":\"" << graph.hardware[hardware].name
+       << "\",\"wait\":" << MetricsJSON(hardwareWait[hardware])
+       << ",\"depth\":" << MetricsJSON(hardwareDepth[hardware]) << "}";
+    separator = ",\n";
+  }
+  os << "\n]}\n";
+}
+
+uint64_t SIMEngine::RegisterInstance(int32_t op,
+                                     const std::vector<uint64_t> &pre,
+                                     uint64_t rank) {
+  instanceOp.emplace_back(op);
+  instanceReleaseTime.emplace_back(virtualNow);
+  instanceRank.emplace_back(rank);
+  if (trace) {
+    instanceFlow.emplace_back(simuFlow);
+  }
+  if (metrics) {
+    instanceInvocation.emplace_back(invocationFlow.size() - 1);
+  }
+  preIds.insert(preIds.end(), pre.begin(), pre.end());
+  preOffset.emplace_back(preIds.size());
+  return instanceOp.size() - 1;
+}
+
+/*
+  Registers the instances of one call of flow. Nested flow calls are walked
+  with an explicit stack of frames, one per call in progress, so deep call
+  chains cost no native stack. Ids are appended to out in registration
+  order, so the ids of a call already sit inside those of its caller and
+  nothing is copied when it returns; the predecessors of a call are the
+  nodePre of the frame that made it.
+*/
+void SIMEngine::Instantiate(int32_t flow, const std::vector<uint64_t> &pre,
+                            uint64_t tailRank, std::vector<uint64_t> &out) {
+  struct Frame {
+    int32_t flow;
+    uint64_t tailRank;
+    // frame whose nodePre are the predecessors of this call, -1: pre
+    int32_t preFrame;
+    int32_t node;
+    // iterations of the current node's flow call done so far
+    int32_t loopI;
+    // ids of node i are out[nodeBegin[i], nodeBegin[i + 1])
+    std::vector<size_t> nodeBegin;
+    std::vector<uint64_t> nodePre;
+  };
+  // frames above depth are kept for their buffers
+  std::vector<Frame> frames;
+  int32_t depth = 0;
+  auto Push = [&](int32_t flow, uint64_t tailRank, int32_t preFrame) {
+    if (depth == frames.size()) {
+      frames.emplace_back();
+    }
+    Frame &frame = frames[depth++];
+    frame.flow = flow;
+    frame.tailRank = tailRank;
+    frame.preFrame = preFrame;
+    frame.node = 0;
+    frame.loopI = 0;
+    frame.nodeBegin.assign(1, out.size());
+  };
+  // predecessors of the current node of frame `cur`
+  auto NodePreFrame = [&](int32_t cur) {
+    const Frame &frame = frames[cur];
+    auto &node = graph.flows[frame.flow].nodes[frame.node];
+    return node.preNodes.empty() ? frame.preFrame : cur;
+  };
+  // the current node of frame `cur` calls its flow once more
+  auto Call = [&](int32_t cur) {
+    const Frame &frame = frames[cur];
+    auto &node = graph.flows[frame.flow].nodes[frame.node];
+    Push(node.flow,
+         frame.tailRank + node.rank - graph.flows[node.flow].criticalPath,
+         NodePreFrame(cur));
+  };
+  auto NextNode = [&](Frame &frame) {
+    frame.nodeBegin.emplace_back(out.size());
+    frame.node++;
+    frame.loopI = 0;
+  };
+
+  Push(flow, tailRank, -1);
+  while (depth > 0) {
+    int32_t cur = depth - 1;
+    Frame &frame = frames[cur];
+    auto &nodes = graph.flows[frame.flow].nodes;
+    if (frame.node == nodes.size()) {
+      depth--;
+      if (cur == 0) {
+        break;
+      }
+      Frame &caller = frames[cur - 1];
+      if (++caller.loopI < graph.flows[caller.flow].nodes[caller.node].repeat) {
+        Call(cur - 1);
+      } else {
+        NextNode(caller);
+      }
+      continue;
+    }
+
+    auto &node = nodes[frame.node];
+    if (!node.preNodes.empty()) {
+      frame.nodePre.clear();
+      for (auto preNode : node.preNodes) {
+        frame.nodePre.insert(frame.nodePre.end(),
+                             out.begin() + frame.nodeBegin[preNode],
+                             out.begin() + frame.nodeBegin[preNode + 1]);
+      }
+    }
+    if (node.op >= 0) {
+      int32_t preFrame = NodePreFrame(cur);
+      const std::vector<uint64_t> &nodePre =
+          preFrame < 0 ? pre : frames[preFrame].nodePre;
+      out.emplace_back(
+          RegisterInstance(node.op, nodePre, frame.tailRank + node.rank));
+      NextNode(frame);
+    } else if (node.repeat > 0) {
+      Call(cur);
+    } else {
+      NextNode(frame);
+    }
+  }
+}
+
+void SIMEngine::RunSimu(int32_t begin, int32_t end) {
+  std::vector<uint64_t> ids;
+  for (int32_t i = begin; i < end; i++) {
+    auto &step = graph.simu[i];
+    if (step.kind == SIMTaskGraph::SimuStep::Call) {
+      ids.clear();
+      BeginFlow(step.arg);
+      Instantiate(step.arg, {}, 0, ids);
+    } else if (step.kind == SIMTaskGraph::SimuStep::Sleep) {
+      virtualNow += step.arg;
+    } else {
+      for (int64_t loopI = 0; loopI < step.arg; loopI++) {
+        RunSimu(i + 1, step.bodyEnd);
+      }
+      i = step.bodyEnd - 1;
+    }
+  }
+}
+
+/*
+  Ready instances of one hardware. Fifo pops in push order, CriticalPath
+  pops the highest rank and breaks ties in push order, so both are
+  deterministic.
+*/
+struct SIMReadyQueue {
+  SIMSchedulerPolicy policy;
+  const std::vector<uint64_t> &instanceRank;
+  std::queue<uint64_t> fifo;
+  // (rank, -push order, id)
+  std::priority_queue<std::tuple<uint64_t, int64_t, uint64_t>> ranked;
+  int64_t pushCnt = 0;
+
+  void Push(uint64_t id) {
+    if (policy == SIMSchedulerPolicy::Fifo) {
+      fifo.push(id);
+    } else {
+      ranked.emplace(instanceRank[id], -pushCnt++, id);
+    }
+  }
+  bool Empty() const {
+    return policy == SIMSchedulerPolicy::Fifo ? fifo.empty() : ranked.empty();
+  }
+  size_t Size() const {
+    return policy == SIMSchedulerPolicy::Fifo ? fifo.size() : ranked.size();
+  }
+  uint64_t Pop() {
+    uint64_t id;
+    if (policy == SIMSchedulerPolicy::Fifo) {
+      id = fifo.front();
+      fifo.pop();
+    } else {
+      id = std::get<2>(ranked.top());
+      ranked.pop();
+    }
+    return id;
+  }
+};
+
+/*
+  Same event order as DiscreteEventScheduler in the emitted code: releases are
+  already sorted by id and time, so they are merged from a cursor instead of
+  going through the heap, and at equal time they are handled before
+  completions.
+*/
+void SIMEngine::RunEvents(SIMEngineResult &result) {
+  struct Completion {
+    uint64_t time;
+    uint64_t seq;
+    uint64_t id;
+    int32_t device;
+    bool operator>(const Completion &other) const {
+      return time != other.time ? time > other.time : seq > other.seq;
+    }
+  };
+
+  uint64_t instanceCnt = instanceOp.size();
+  // CSR successors, in registration order of the successor
+  std::vector<uint64_t> postOffset(instanceCnt + 1, 0), postIds(preIds.size());
+  for (auto preId : preIds) {
+    postOffset[preId + 1]++;
+  }
+  for (uint64_t id = 0; id < instanceCnt; id++) {
+    postOffset[id + 1] += postOffset[id];
+  }
+  std::vector<uint64_t> postFill(postOffset.begin(), postOffset.end() - 1);
+  std::vector<uint32_t> remainingPreCnt(instanceCnt);
+  for (uint64_t id = 0; id < instanceCnt; id++) {
+    remainingPreCnt[id] = preOffset[id + 1] - preOffset[id];
+    for (uint64_t i = preOffset[id]; i < preOffset[id + 1]; i++) {
+      postIds[postFill[preIds[i]]++] = id;
+    }
+  }
+
+  std::vector<SIMReadyQueue> readyQueue(graph.hardware.size(),
+                                       SIMReadyQueue{policy, instanceRank, {}, {}});
+  std::vector<std::vector<bool>> deviceBusy(graph.hardware.size());
+  result.busyTime.assign(graph.hardware.size(), {});
+  for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+    deviceBusy[hardware].assign(graph.hardware[hardware].cnt, false);
+    result.busyTime[hardware].assign(graph.hardware[hardware].cnt, 0);
+  }
+  std::vector<bool> released(instanceCnt, false);
+  std::vector<uint64_t> readyTime(trace || metrics ? instanceCnt : 0);
+  // instances of each flow call that have not completed yet
+  std::vector<uint64_t> invocationPendingCnt(invocationFlow.size());
+  if (metrics) {
+    for (uint64_t invocation : instanceInvocation) {
+      invocationPendingCnt[invocation]++;
+    }
+    result.flowLatency.assign(graph.flows.size(), {});
+    result.hardwareWait.assign(graph.hardware.size(), {});
+    result.hardwareDepth.assign(graph.hardware.size(), {});
+  }
+  std::priority_queue<Completion, std::vector<Completion>,
+                      std::greater<Completion>>
+      completions;
+  uint64_t seq = 0, nextRelease = 0, now = 0;
+
+  auto HardwareOf = [&](uint64_t id) {
+    return graph.operators[instanceOp[id]].hardware;
+  };
+  // hardware that got a ready instance or a free device at `now`; only
+  // these can dispatch, so a time step costs nothing for the others
+  std::vector<int32_t> touched;
+  std::vector<bool> isTouched(graph.hardware.size(), false);
+  auto Touch = [&](int32_t hardware) {
+    if (!isTouched[hardware]) {
+      isTouched[hardware] = true;
+      touched.emplace_back(hardware);
+    }
+  };
+
+  while (nextRelease < instanceCnt || !completions.empty()) {
+    now = UINT64_MAX;
+    if (nextRelease < instanceCnt) {
+      now = instanceReleaseTime[nextRelease];
+    }
+    if (!completions.empty()) {
+      now = std::min(now, completions.top().time);
+    }
+    while (nextRelease < instanceCnt &&
+           instanceReleaseTime[nextRelease] == now) {
+      released[nextRelease] = true;
+      if (remainingPreCnt[nextRelease] == 0) {
+        readyQueue[HardwareOf(nextRelease)].Push(nextRelease);
+        Touch(HardwareOf(nextRelease));
+        if (trace || metrics) {
+          readyTime[nextRelease] = now;
+        }
+      }
+      nextRelease++;
+    }
+    while (!completions.empty() && completions.top().time == now) {
+      Completion completion = completions.top();
+      completions.pop();
+      deviceBusy[HardwareOf(completion.id)][completion.device] = false;
+      Touch(HardwareOf(completion.id));
+      if (metrics) {
+        uint64_t invocation = instanceInvocation[completion.id];
+        if (--invocationPendingCnt[invocation] == 0) {
+          result.flowLatency[invocationFlow[invocation]].Record(
+              now - invocationTime[invocation]);
+        }
+      }
+      for (uint64_t i = postOffset[completion.id];
+           i < postOffset[completion.id + 1]; i++) {
+        uint64_t successorId = postIds[i];
+        if (--remainingPreCnt[successorId] == 0 && released[successorId]) {
+          readyQueue[HardwareOf(successorId)].Push(successorId);
+          Touch(HardwareOf(successorId));
+          if (trace || metrics) {
+            readyTime[successorId] = now;
+          }
+        }
+      }
+    }
+
+    // in hardware order, as a scan of every hardware would dispatch
+    std::sort(touched.begin(), touched.end());
+    for (int32_t hardware : touched) {
+      isTouched[hardware] = false;
+      auto &queue = readyQueue[hardware];
+      auto &devices = deviceBusy[hardware];
+      for (int32_t device = 0; device < devices.size() && !queue.Empty();
+           device++) {
+        if (devices[device]) {
+          continue;
+        }
+        uint64_t id = queue.Pop();
+        int64_t time = graph.operators[instanceOp[id]].time;
+        devices[device] = true;
+        result.busyTime[hardware][device] += time;
+        completions.push({now + time, seq++, id, device});
+        if (trace) {
+          result.trace.push_back({id + 1, instanceOp[id], instanceFlow[id],
+                                  hardware, device, readyTime[id], now,
+                                  now + time});
+        }
+        if (metrics) {
+          result.hardwareWait[hardware].Record(now - readyTime[id]);
+          result.hardwareDepth[hardware].Record(queue.Size());
+        }
+      }
+    }
+    touched.clear();
+  }
+  result.makespan = std::max(instanceCnt ? now : 0, virtualNow);
+  result.instanceCnt = instanceCnt;
+}
+
+uint64_t SIMEngine::RegisterInstanceRanges(int32_t op,
+                                           const uint64_t *preRanges,
+                                           uint64_t rangeCnt, uint64_t rank) {
+  instanceOp.emplace_back(op);
+  instanceReleaseTime.emplace_back(virtualNow);
+  instanceRank.emplace_back(rank);
+  if (trace) {
+    instanceFlow.emplace_back(simuFlow);
+  }
+  if (metrics) {
+    instanceInvocation.emplace_back(invocationFlow.size() - 1);
+  }
+  for (uint64_t range = 0; range < rangeCnt; range++) {
+    for (uint64_t id = preRanges[2 * range]; id < preRanges[2 * range + 1];
+         id++) {
+      preIds.emplace_back(id);
+    }
+  }
+  preOffset.emplace_back(preIds.size());
+  return instanceOp.size() - 1;
+}
+
+void SIMEngine::BeginFlow(int32_t flow) {
+  simuFlow = flow;
+  if (metrics) {
+    invocationFlow.emplace_back(flow);
+    invocationTime.emplace_back(virtualNow);
+  }
+}
+
+void SIMEngine::Reset() {
+  virtualNow = 0;
+  simuFlow = -1;
+  instanceOp.clear();
+  instanceFlow.clear();
+  invocationFlow.clear();
+  invocationTime.clear();
+  instanceInvocation.clear();
+  instanceReleaseTime.clear();
+  instanceRank.clear();
+  preOffset.assign(1, 0);
+  preIds.clear();
+}
+
+SIMEngineResult SIMEngine::Finish() {
+  SIMEngineResult result;
+  RunEvents(result);
+  return result;
+}
+
+SIMEngineResult SIMEngine::Run() {
+  Reset();
+  RunSimu(0, graph.simu.size());
+  return Finish();
+}
+
+} // namespace XPUSchedulerSimulator
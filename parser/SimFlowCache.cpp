@@ -0,0 +1,196 @@
+#include "SimFlowCache.h"
+
+#include <unistd.h>
+
+#include <cinttypes>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace XPUSchedulerSimulator {
+
+// bump whenever the emitted flow functions change shape
+static const char *kFlowCacheMagic = "arcticflow flow cache 2";
+
+// 64-bit FNV-1a, every string is prefixed by its length
+struct SIMHasher {
+  uint64_t hash = 14695981039346656037ull;
+
+  void Add(const void *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ static_cast<const uint8_t *>(data)[i]) * 1099511628211ull;
+    }
+  }
+  void Add(uint64_t value) { Add(&value, sizeof(value)); }
+  void Add(const std::string &str) {
+    Add(str.size());
+    Add(str.data(), str.size());
+  }
+};
+
+// structure of the block and every symbol it names, in source order
+static void HashFlowBlock(SIMHasher &hasher, SIMFlowBlock *block,
+                          std::vector<SIMSymbol *> &refs) {
+  hasher.Add(block->exprs.size());
+  for (auto *chain : block->exprs) {
+    hasher.Add(chain->stages.size());
+    for (auto *stage : chain->stages) {
+      if (SIMFlowUnaryExpression *unaryExpr =
+              dynamic_cast<SIMFlowUnaryExpression *>(stage)) {
+        hasher.Add('u');
+        hasher.Add(unaryExpr->opName->name);
+        refs.emplace_back(unaryExpr->opName);
+      } else if (SIMForeachExpression *foreachExpr =
+                     dynamic_cast<SIMForeachExpression *>(stage)) {
+        hasher.Add('f');
+        hasher.Add(foreachExpr->loopCnt);
+        HashFlowBlock(hasher,
+                      dynamic_cast<SIMFlowBlock *>(foreachExpr->loopBlock),
+                      refs);
+      } else {
+        hasher.Add('x');
+      }
+    }
+  }
+}
+
+/*
+  Callees are keyed first, by a post-order walk over the flow call graph
+  with an explicit stack like SIMTaskGraph::RankFlow. A name resolves the
+  way lowering resolves it: operator first, then flow.
+*/
+bool SIMFlowCache::ComputeKeys(SIMTranslationUnit *unit) {
+  keys.clear();
+  if (unit->op == nullptr) {
+    return false;
+  }
+  size_t symbolCnt = unit->symbols.size();
+  std::vector<int64_t> opTime(symbolCnt, -1);
+  for (auto *expr : unit->op->exprs) {
+    opTime[expr->opName->id] = expr->time;
+  }
+  std::vector<SIMFlowBlock *> blockOf(symbolCnt, nullptr);
+  for (auto &[sym, block] : unit->flowBlocks) {
+    blockOf[sym->id] = block;
+  }
+
+  enum : uint8_t { Unvisited, Visiting, Keyed };
+  std::vector<uint8_t> state(symbolCnt, Unvisited);
+  std::vector<uint64_t> keyOf(symbolCnt), localHash(symbolCnt);
+  std::vector<std::vector<SIMSymbol *>> refsOf(symbolCnt);
+  // flow, next referenced symbol
+  std::vector<std::pair<SIMSymbol *, int32_t>> stack;
+  auto push = [&](SIMSymbol *flow) {
+    SIMHasher hasher;
+    HashFlowBlock(hasher, blockOf[flow->id], refsOf[flow->id]);
+    localHash[flow->id] = hasher.hash;
+    state[flow->id] = Visiting;
+    stack.emplace_back(flow, 0);
+  };
+  for (auto &[sym, block] : unit->flowBlocks) {
+    if (state[sym->id] != Unvisited) {
+      continue;
+    }
+    push(sym);
+    while (!stack.empty()) {
+      auto &[flow, nextRef] = stack.back();
+      auto &refs = refsOf[flow->id];
+      if (nextRef < refs.size()) {
+        SIMSymbol *ref = refs[nextRef++];
+        if (opTime[ref->id] >= 0 || blockOf[ref->id] == nullptr ||
+            state[ref->id] == Keyed) {
+          continue;
+        }
+        if (state[ref->id] == Visiting) {
+          return false;
+        }
+        push(ref);
+        continue;
+      }
+      SIMHasher hasher;
+      hasher.Add(std::string(kFlowCacheMagic));
+      hasher.Add(flow->name);
+      hasher.Add(localHash[flow->id]);
+      for (SIMSymbol *ref : refs) {
+        if (opTime[ref->id] >= 0) {
+          hasher.Add('o');
+          hasher.Add(opTime[ref->id]);
+        } else if (blockOf[ref->id] != nullptr) {
+          hasher.Add('F');
+          hasher.Add(keyOf[ref->id]);
+        } else {
+          hasher.Add('?');
+        }
+      }
+      keyOf[flow->id] = hasher.hash;
+      state[flow->id] = Keyed;
+      keys[flow->name] = hasher.hash;
+      std::vector<SIMSymbol *>().swap(refs);
+      stack.pop_back();
+    }
+  }
+  return true;
+}
+
+static std::string FlowCachePath(const std::string &dir, uint64_t key) {
+  return StringFormat("%s/%016" PRIx64 ".flow", dir.c_str(), key);
+}
+
+/*
+  Entry layout: the magic line, "<key> <criticalPath> <foreachCnt>
+  <textSize>", one foreach name per line, then the text verbatim. Anything
+  that does not parse is a miss.
+*/
+bool SIMFlowCache::Load(uint64_t key, SIMFlowCacheEntry &entry) const {
+  std::ifstream file(FlowCachePath(dir, key), std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::string magic;
+  uint64_t storedKey = 0;
+  size_t foreachCnt = 0, textSize = 0;
+  if (!std::getline(file, magic) || magic != kFlowCacheMagic ||
+      !(file >> storedKey >> entry.stub.criticalPath >> foreachCnt >>
+        textSize) ||
+      storedKey != key || file.get() != '\n') {
+    return false;
+  }
+  entry.stub.foreachNames.resize(foreachCnt);
+  for (auto &name : entry.stub.foreachNames) {
+    if (!std::getline(file, name)) {
+      return false;
+    }
+  }
+  entry.text.resize(textSize);
+  file.read(&entry.text[0], textSize);
+  return file.gcount() == static_cast<std::streamsize>(textSize);
+}
+
+void SIMFlowCache::Store(uint64_t key, const SIMFlowCacheEntry &entry) const {
+  std::error_code error;
+  std::filesystem::create_directories(dir, error);
+  std::string path = FlowCachePath(dir, key);
+  std::string tmpPath =
+      StringFormat("%s.%d.%zu.tmp", path.c_str(), getpid(),
+                   std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream file(tmpPath, std::ios::binary);
+    file << kFlowCacheMagic << "\n"
+         << key << " " << entry.stub.criticalPath << " "
+         << entry.stub.foreachNames.size() << " " << entry.text.size() << "\n";
+    for (auto &name : entry.stub.foreachNames) {
+      file << name << "\n";
+    }
+    file.write(entry.text.data(), entry.text.size());
+    if (!file) {
+      file.close();
+      std::filesystem::remove(tmpPath, error);
+      return;
+    }
+  }
+  std::filesystem::rename(tmpPath, path, error);
+}
+
+} // namespace XPUSchedulerSimulator
@@ -0,0 +1,934 @@
+#include "SimPreProcessor.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include "SimAST.h"
+
+namespace XPUSchedulerSimulator {
+
+// far deeper than any real header tree, stops #include cycles
+static const int32_t kMaxIncludeDepth = 200;
+
+// by SIMPreFile::Kind
+static const char *kDirectiveNames[] = {
+    "include", "define", "undef", "if",    "ifdef",   "ifndef",
+    "elif",    "else",   "endif", "error", "warning", "pragma"};
+
+static bool IsIdentBegin(char c) {
+  return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool IsIdentChar(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// end of the identifier at pos, pos if there is none
+static size_t IdentEnd(std::string_view str, size_t pos) {
+  if (pos >= str.size() || !IsIdentBegin(str[pos])) {
+    return pos;
+  }
+  while (pos < str.size() && IsIdentChar(str[pos])) {
+    pos++;
+  }
+  return pos;
+}
+
+static std::string_view Trim(std::string_view str) {
+  size_t begin = str.find_first_not_of(" \t\r\n");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  return str.substr(begin, str.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// length of the backslash-newline at pos, 0 if there is none
+static size_t SpliceAt(std::string_view text, size_t pos) {
+  if (text[pos] != '\\') {
+    return 0;
+  }
+  if (pos + 1 < text.size() && text[pos + 1] == '\n') {
+    return 2;
+  }
+  if (pos + 2 < text.size() && text[pos + 1] == '\r' && text[pos + 2] == '\n') {
+    return 3;
+  }
+  return 0;
+}
+
+// end of the number starting at pos, so that `2x` never expands x
+static size_t SkipNumber(std::string_view text, size_t pos) {
+  while (pos < text.size() && (IsIdentChar(text[pos]) || text[pos] == '.')) {
+    pos++;
+  }
+  return pos;
+}
+
+// name, parameters and body of a #define
+static void ParseDefine(SIMPreFile::Directive &directive) {
+  std::string_view args = directive.args;
+  size_t nameEnd = IdentEnd(args, 0);
+  if (nameEnd == 0) {
+    directive.error = "macro name expected after #define";
+    return;
+  }
+  directive.name = std::string(args.substr(0, nameEnd));
+  std::string_view rest = args.substr(nameEnd);
+  if (!rest.empty() && rest[0] == '(') {
+    directive.macro.functionLike = true;
+    size_t close = rest.find(')');
+    if (close == std::string_view::npos) {
+      directive.error = "missing ) in the parameters of " + directive.name;
+      return;
+    }
+    std::string_view params = Trim(rest.substr(1, close - 1));
+    rest = rest.substr(close + 1);
+    while (!params.empty()) {
+      size_t comma = params.find(',');
+      std::string_view param = Trim(params.substr(0, comma));
+      if (param.empty() || IdentEnd(param, 0) != param.size() ||
+          (comma != std::string_view::npos &&
+           Trim(params.substr(comma + 1)).empty())) {
+        directive.error = "invalid parameters of " + directive.name;
+        return;
+      }
+      directive.macro.params.emplace_back(param);
+      params = comma == std::string_view::npos ? std::string_view()
+                                               : params.substr(comma + 1);
+    }
+  }
+  directive.macro.body = std::string(Trim(rest));
+}
+
+// the macro of an #ifndef / #define ... #endif that wraps the whole file
+static std::string IncludeGuard(const SIMPreFile &file) {
+  auto &directives = file.directives;
+  if (directives.size() < 3 || directives[0].kind != SIMPreFile::Ifndef ||
+      !directives[0].error.empty() ||
+      directives[1].kind != SIMPreFile::Define ||
+      directives[1].name != directives[0].name ||
+      directives.back().kind != SIMPreFile::Endif ||
+      !Trim(file.text.substr(0, directives[0].pos)).empty() ||
+      !Trim(file.text.substr(directives.back().pos)).empty()) {
+    return "";
+  }
+  int32_t nesting = 0;
+  for (size_t i = 0; i < directives.size(); i++) {
+    switch (directives[i].kind) {
+    case SIMPreFile::If:
+    case SIMPreFile::Ifdef:
+    case SIMPreFile::Ifndef:
+      nesting++;
+      break;
+    case SIMPreFile::Elif:
+    case SIMPreFile::Else:
+      if (nesting == 1) {
+        return "";
+      }
+      break;
+    case SIMPreFile::Endif:
+      if (--nesting == 0 && i + 1 != directives.size()) {
+        return "";
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return directives[0].name;
+}
+
+/*
+  Integer expression of an #if after expansion, by precedence climbing.
+  Identifiers still left are 0, as in C. As in C, the right operand of
+  && and || and the untaken branch of ?: are parsed but not evaluated, so
+  `0 && 1/0` is 0. Errors throw std::logic_error.
+*/
+class SIMPreExpr {
+public:
+  explicit SIMPreExpr(std::string_view text) : text(text) {}
+
+  int64_t Evaluate() {
+    int64_t value = Ternary();
+    SkipBlanks();
+    if (pos != text.size()) {
+      throw std::logic_error("unexpected " + std::string(text.substr(pos)));
+    }
+    return value;
+  }
+
+private:
+  std::string_view text;
+  size_t pos = 0;
+  // > 0 while parsing an operand whose value is not used
+  int32_t unevaluated = 0;
+
+  void SkipBlanks() {
+    while (pos < text.size() &&
+           std::isspace(static_cast<unsigned char>(text[pos]))) {
+      pos++;
+    }
+  }
+  // operator at pos, longest match first
+  std::string_view PeekOp() {
+    static const char *kOps[] = {"||", "&&", "==", "!=", "<=", ">=",
+                                 "<<", ">>", "|",  "^",  "&",  "<",
+                                 ">",  "+",  "-",  "*",  "/",  "%",
+                                 "!",  "~",  "(",  ")",  "?",  ":"};
+    SkipBlanks();
+    for (const char *op : kOps) {
+      size_t len = std::strlen(op);
+      if (text.compare(pos, len, op) == 0) {
+        return text.substr(pos, len);
+      }
+    }
+    return {};
+  }
+  void Expect(std::string_view op) {
+    if (PeekOp() != op) {
+      throw std::logic_error("expected " + std::string(op));
+    }
+    pos += op.size();
+  }
+  static int32_t Precedence(std::string_view op) {
+    static const std::pair<const char *, int32_t> kPrecedence[] = {
+        {"||", 1}, {"&&", 2}, {"|", 3},  {"^", 4},  {"&", 5},  {"==", 6},
+        {"!=", 6}, {"<", 7},  {">", 7},  {"<=", 7}, {">=", 7}, {"<<", 8},
+        {">>", 8}, {"+", 9},  {"-", 9},  {"*", 10}, {"/", 10}, {"%", 10}};
+    for (auto &[name, precedence] : kPrecedence) {
+      if (op == name) {
+        return precedence;
+      }
+    }
+    return 0;
+  }
+  static int64_t Apply(std::string_view op, int64_t lhs, int64_t rhs) {
+    // wrap around instead of overflowing
+    uint64_t a = lhs, b = rhs;
+    if ((op == "/" || op == "%") && rhs == 0) {
+      throw std::logic_error("division by zero");
+    }
+    if ((op == "<<" || op == ">>") && (rhs < 0 || rhs > 63)) {
+      throw std::logic_error("shift out of range");
+    }
+    if (op == "||") return lhs || rhs;
+    if (op == "&&") return lhs && rhs;
+    if (op == "|") return lhs | rhs;
+    if (op == "^") return lhs ^ rhs;
+    if (op == "&") return lhs & rhs;
+    if (op == "==") return lhs == rhs;
+    if (op == "!=") return lhs != rhs;
+    if (op == "<") return lhs < rhs;
+    if (op == ">") return lhs > rhs;
+    if (op == "<=") return lhs <= rhs;
+    if (op == ">=") return lhs >= rhs;
+    if (op == "<<") return a << rhs;
+    if (op == ">>") return lhs >> rhs;
+    if (op == "+") return a + b;
+    if (op == "-") return a - b;
+    if (op == "*") return a * b;
+    if (lhs == INT64_MIN && rhs == -1) return op == "/" ? lhs : 0;
+    return op == "/" ? lhs / rhs : lhs % rhs;
+  }
+
+  int64_t Ternary() {
+    int64_t cond = Binary(1);
+    if (PeekOp() != "?") {
+      return cond;
+    }
+    pos++;
+    unevaluated += !cond;
+    int64_t ifTrue = Ternary();
+    unevaluated -= !cond;
+    Expect(":");
+    unevaluated += cond != 0;
+    int64_t ifFalse = Ternary();
+    unevaluated -= cond != 0;
+    return cond ? ifTrue : ifFalse;
+  }
+  int64_t Binary(int32_t minPrecedence) {
+    int64_t lhs = Unary();
+    for (;;) {
+      std::string_view op = PeekOp();
+      int32_t precedence = Precedence(op);
+      if (precedence == 0 || precedence < minPrecedence) {
+        return lhs;
+      }
+      pos += op.size();
+      // the left operand already decides the result
+      bool decided = (op == "&&" && !lhs) || (op == "||" && lhs);
+      unevaluated += decided;
+      int64_t rhs = Binary(precedence + 1);
+      unevaluated -= decided;
+      if (decided) {
+        lhs = op == "||";
+      } else if (unevaluated == 0) {
+        lhs = Apply(op, lhs, rhs);
+      }
+    }
+  }
+  int64_t Unary() {
+    std::string_view op = PeekOp();
+    if (op == "!" || op == "~" || op == "-" || op == "+") {
+      pos++;
+      int64_t value = Unary();
+      return op == "!"   ? !value
+             : op == "~" ? ~value
+             : op == "-" ? -static_cast<uint64_t>(value)
+                         : value;
+    }
+    if (op == "(") {
+      pos++;
+      int64_t value = Ternary();
+      Expect(")");
+      return value;
+    }
+    if (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos]))) {
+      size_t end = SkipNumber(text, pos);
+      std::string digits(text.substr(pos, end - pos));
+      while (!digits.empty() && std::strchr("uUlL", digits.back()) != nullptr) {
+        digits.pop_back();
+      }
+      size_t used = 0;
+      // stoull throws std::invalid_argument / std::out_of_range, both
+      // logic_errors
+      uint64_t value = std::stoull(digits, &used, 0);
+      if (used != digits.size()) {
+        throw std::logic_error("invalid number " + digits);
+      }
+      pos = end;
+      return value;
+    }
+    if (size_t end = IdentEnd(text, pos); end != pos) {
+      pos = end;
+      return 0;
+    }
+    throw std::logic_error(pos == text.size()
+                               ? std::string("missing value")
+                               : "unexpected " + std::string(text.substr(pos)));
+  }
+};
+
+void SIMPreProcessor::Run(const SIMSource &source) {
+  macros.clear();
+  conditionals.clear();
+  walked.clear();
+  out.clear();
+  outLines = 0;
+  if (includeDirs != graphIncludeDirs) {
+    includeGraph.clear();
+    graphIncludeDirs = includeDirs;
+  }
+  output = std::make_unique<SIMSource>();
+  std::unique_ptr<SIMPreFile> file = Scan(source);
+  if (file->directives.empty() && file->text.data() == source.Text().data()) {
+    // nothing to change, the lexer reads the source itself
+    result = &source;
+    return;
+  }
+  result = output.get();
+  Walk(*file, 0);
+  output->Assign(std::move(out));
+  out = std::string();
+}
+
+void SIMPreProcessor::Error(const SIMSource &file, int32_t lineno,
+                            const std::string &message) {
+  throw std::logic_error(StringFormat(
+      "%s:%d: %s", file.Path().empty() ? "<input>" : file.Path().c_str(),
+      lineno, message.c_str()));
+}
+
+/*
+  Text between flushes is appended as one span. A newline is never dropped:
+  one spliced away or inside a comment is written after the end of the
+  logical line, so line n of the file stays line n of the text.
+*/
+std::unique_ptr<SIMPreFile> SIMPreProcessor::Scan(const SIMSource &source) const {
+  auto file = std::make_unique<SIMPreFile>();
+  file->source = &source;
+  std::string_view text = source.Text();
+  std::string &out = file->stripped;
+  size_t n = text.size(), i = 0, spanBegin = 0;
+  int32_t lineno = 1, pendingLines = 0;
+  // only blanks since the last newline, `#` starts a directive
+  bool lineStart = true;
+
+  auto flush = [&](size_t end) {
+    out.append(text.data() + spanBegin, end - spanBegin);
+    spanBegin = end;
+  };
+  auto skipComment = [&]() {
+    if (text[i + 1] == '/') {
+      i += 2;
+      while (i < n && text[i] != '\n') {
+        if (size_t splice = SpliceAt(text, i)) {
+          i += splice;
+          lineno++;
+          pendingLines++;
+        } else {
+          i++;
+        }
+      }
+      return;
+    }
+    size_t end = text.find("*/", i + 2);
+    if (end == std::string_view::npos) {
+      Error(source, lineno, "unterminated comment");
+    }
+    int32_t lines = std::count(text.begin() + i, text.begin() + end, '\n');
+    lineno += lines;
+    pendingLines += lines;
+    i = end + 2;
+  };
+  auto isComment = [&]() {
+    return text[i] == '/' && i + 1 < n &&
+           (text[i + 1] == '/' || text[i + 1] == '*');
+  };
+
+  while (i < n) {
+    char c = text[i];
+    if (c == '\n') {
+      i++;
+      if (pendingLines > 0) {
+        flush(i);
+        out.append(pendingLines, '\n');
+        pendingLines = 0;
+      }
+      lineno++;
+      lineStart = true;
+    } else if (size_t splice = SpliceAt(text, i)) {
+      flush(i);
+      i += splice;
+      spanBegin = i;
+      lineno++;
+      pendingLines++;
+    } else if (isComment()) {
+      flush(i);
+      skipComment();
+      spanBegin = i;
+      out += ' ';
+    } else if (c == '#') {
+      size_t nameBegin = i + 1;
+      while (nameBegin < n &&
+             (text[nameBegin] == ' ' || text[nameBegin] == '\t')) {
+        nameBegin++;
+      }
+      size_t nameEnd = IdentEnd(text, nameBegin);
+      std::string_view name = text.substr(nameBegin, nameEnd - nameBegin);
+      auto kind = std::find(std::begin(kDirectiveNames),
+                            std::end(kDirectiveNames), name);
+      if (lineStart && kind != std::end(kDirectiveNames)) {
+        flush(i);
+        SIMPreFile::Directive &directive = file->directives.emplace_back();
+        directive.kind =
+            static_cast<SIMPreFile::Kind>(kind - std::begin(kDirectiveNames));
+        directive.lineno = lineno;
+        directive.pos = out.size();
+        for (i = nameEnd; i < n && text[i] != '\n';) {
+          if (size_t splice = SpliceAt(text, i)) {
+            i += splice;
+            lineno++;
+            pendingLines++;
+          } else if (isComment()) {
+            skipComment();
+            directive.args += ' ';
+          } else {
+            directive.args += text[i++];
+          }
+        }
+        directive.args = std::string(Trim(directive.args));
+        std::string_view args = directive.args;
+        switch (directive.kind) {
+        case SIMPreFile::Define:
+          ParseDefine(directive);
+          break;
+        case SIMPreFile::Undef:
+        case SIMPreFile::Ifdef:
+        case SIMPreFile::Ifndef:
+          directive.name = std::string(args.substr(0, IdentEnd(args, 0)));
+          if (directive.name.empty()) {
+            directive.error = StringFormat("macro name expected after #%s",
+                                           kDirectiveNames[directive.kind]);
+          }
+          break;
+        case SIMPreFile::Include:
+          if (args.size() < 2 ||
+              !((args.front() == '"' && args.back() == '"') ||
+                (args.front() == '<' && args.back() == '>'))) {
+            directive.error = "#include expects \"file\" or <file>";
+          }
+          break;
+        case SIMPreFile::Pragma:
+          file->once = file->once || args == "once";
+          break;
+        default:
+          break;
+        }
+        spanBegin = i;
+      } else {
+        // an .arc comment, left for the lexer
+        const char *eol = static_cast<const char *>(
+            std::memchr(text.data() + i, '\n', n - i));
+        i = eol != nullptr ? eol - text.data() : n;
+      }
+      lineStart = false;
+    } else {
+      lineStart = lineStart && (c == ' ' || c == '\t' || c == '\r');
+      i++;
+    }
+  }
+
+  if (spanBegin == 0) {
+    file->text = text;
+  } else {
+    flush(n);
+    out.append(pendingLines, '\n');
+    file->text = out;
+  }
+  file->lineCnt = lineno - 1;
+  file->guard = IncludeGuard(*file);
+  return file;
+}
+
+/*
+  The output line of the current run of lines of a file is known from the
+  line it starts at, so nothing is counted while text is copied. Skipped
+  groups are replaced by their newlines.
+*/
+void SIMPreProcessor::Walk(const SIMPreFile &file, int32_t depth) {
+  const SIMSource &source = *file.source;
+  std::string_view text = file.text;
+  size_t conditionalBase = conditionals.size();
+  walked.insert(&file);
+  int32_t runOutLines = outLines, runLineno = 1;
+  output->MapLines(outLines + 1, &source, 1);
+
+  size_t pos = 0;
+  int32_t lineno = 1;
+  // text up to end, which is on line endLineno
+  auto emit = [&](size_t end, int32_t endLineno) {
+    if (!Active()) {
+      out.append(endLineno - lineno, '\n');
+    } else if (macros.empty()) {
+      out.append(text.substr(pos, end - pos));
+    } else {
+      std::vector<const std::string *> expanding;
+      Expand(text.substr(pos, end - pos), out, expanding, source, lineno);
+    }
+    pos = end;
+    lineno = endLineno;
+  };
+
+  for (auto &directive : file.directives) {
+    emit(directive.pos, directive.lineno);
+    const char *name = kDirectiveNames[directive.kind];
+    switch (directive.kind) {
+    case SIMPreFile::If:
+    case SIMPreFile::Ifdef:
+    case SIMPreFile::Ifndef: {
+      bool cond = false;
+      if (Active()) {
+        if (!directive.error.empty()) {
+          Error(source, directive.lineno, directive.error);
+        }
+        cond = directive.kind == SIMPreFile::If
+                   ? Evaluate(source, directive)
+                   : (macros.find(directive.name) != macros.end()) ==
+                         (directive.kind == SIMPreFile::Ifdef);
+      }
+      conditionals.push_back(
+          {Active() && cond, cond, false, Active(), directive.lineno});
+      continue;
+    }
+    case SIMPreFile::Elif:
+    case SIMPreFile::Else:
+    case SIMPreFile::Endif: {
+      if (conditionals.size() <= conditionalBase) {
+        Error(source, directive.lineno,
+              StringFormat("#%s without #if", name));
+      }
+      Conditional &cond = conditionals.back();
+      if (directive.kind == SIMPreFile::Endif) {
+        conditionals.pop_back();
+        continue;
+      }
+      if (cond.seenElse) {
+        Error(source, directive.lineno,
+              StringFormat("#%s after #else", name));
+      }
+      if (directive.kind == SIMPreFile::Else) {
+        cond.seenElse = true;
+        cond.active = cond.parentActive && !cond.taken;
+      } else {
+        cond.active = cond.parentActive && !cond.taken &&
+                      Evaluate(source, directive);
+      }
+      cond.taken = cond.taken || cond.active;
+      continue;
+    }
+    default:
+      break;
+    }
+    if (!Active()) {
+      continue;
+    }
+    if (!directive.error.empty()) {
+      Error(source, directive.lineno, directive.error);
+    }
+
+    switch (directive.kind) {
+    case SIMPreFile::Define:
+      macros[directive.name] = directive.macro;
+      break;
+    case SIMPreFile::Undef:
+      if (auto macro = macros.find(directive.name); macro != macros.end()) {
+        macros.erase(macro);
+      }
+      break;
+    case SIMPreFile::Include: {
+      const SIMPreFile *included = Resolve(file, directive);
+      if ((included->once && walked.count(included) != 0) ||
+          (!included->guard.empty() &&
+           macros.find(included->guard) != macros.end())) {
+        break;
+      }
+      if (depth + 1 >= kMaxIncludeDepth) {
+        Error(source, directive.lineno, "#include nested too deeply");
+      }
+      outLines = runOutLines + (directive.lineno - runLineno);
+      Walk(*included, depth + 1);
+      // the rest of the directive line
+      runOutLines = outLines;
+      runLineno = directive.lineno;
+      output->MapLines(outLines + 1, &source, directive.lineno);
+      break;
+    }
+    case SIMPreFile::Error:
+      Error(source, directive.lineno, "#error " + directive.args);
+    case SIMPreFile::Warning:
+      std::cerr << (source.Path().empty() ? "<input>" : source.Path()) << ":"
+                << directive.lineno << ": warning: " << directive.args
+                << std::endl;
+      break;
+    default:
+      // #pragma once is read by Scan, other pragmas are ignored
+      break;
+    }
+  }
+  emit(text.size(), file.lineCnt + 1);
+  outLines = runOutLines + (file.lineCnt + 1 - runLineno);
+
+  if (conditionals.size() > conditionalBase) {
+    Error(source, conditionals.back().lineno, "#if without #endif");
+  }
+}
+
+/*
+  An #include is resolved once per includer directory and name; every
+  later run, and every other file in the directory naming the same header,
+  takes the edge from includeGraph. Files are keyed by canonical path, so
+  two spellings of one header still share one SIMPreFile.
+*/
+const SIMPreFile *
+SIMPreProcessor::Resolve(const SIMPreFile &file,
+                         const SIMPreFile::Directive &include) {
+  const SIMSource &source = *file.source;
+  std::string_view args = include.args;
+  bool quoted = args.front() == '"';
+  std::filesystem::path name(args.substr(1, args.size() - 2));
+  std::filesystem::path dir;
+  if (quoted && !name.is_absolute()) {
+    dir = std::filesystem::path(source.Path()).parent_path();
+  }
+  std::string key = dir.string() + '\0' + std::string(args);
+  if (auto edge = includeGraph.find(key); edge != includeGraph.end()) {
+    return edge->second;
+  }
+
+  std::vector<std::filesystem::path> candidates;
+  if (name.is_absolute()) {
+    candidates.emplace_back(name);
+  } else {
+    if (quoted) {
+      candidates.emplace_back(dir / name);
+    }
+    for (auto &includeDir : includeDirs) {
+      candidates.emplace_back(std::filesystem::path(includeDir) / name);
+    }
+  }
+  for (auto &candidate : candidates) {
+    std::error_code error;
+    std::string path = std::filesystem::canonical(candidate, error).string();
+    if (error == std::errc::no_such_file_or_directory ||
+        error == std::errc::not_a_directory) {
+      continue;
+    }
+    if (error) {
+      Error(source, include.lineno,
+            "cannot open " + candidate.string() + ": " + error.message());
+    }
+    auto cached = files.find(path);
+    if (cached == files.end()) {
+      auto includedSource = std::make_unique<SIMSource>();
+      if (!includedSource->Map(candidate.string())) {
+        Error(source, include.lineno,
+              "cannot open " + candidate.string() + ": " +
+                  std::strerror(errno));
+      }
+      std::unique_ptr<SIMPreFile> included = Scan(*includedSource);
+      included->ownedSource = std::move(includedSource);
+      cached = files.emplace(path, std::move(included)).first;
+    }
+    return includeGraph[key] = cached->second.get();
+  }
+  Error(source, include.lineno, "cannot find " + name.string());
+}
+
+/*
+  Arguments are expanded before they are substituted and the result is
+  rescanned with the macro disabled, as in C. A function-like name the
+  replacement ends in takes its arguments from the text after the call,
+  so `#define F G` makes `F(1)` a call of G; the macros of the finished
+  call are enabled again by then. A call may span lines; its newlines are
+  written after the expansion so later lines keep their numbers.
+*/
+void SIMPreProcessor::Expand(std::string_view text, std::string &dst,
+                             std::vector<const std::string *> &expanding,
+                             const SIMSource &file, int32_t lineno) {
+  size_t n = text.size(), i = 0, spanBegin = 0;
+  while (i < n) {
+    char c = text[i];
+    if (c == '\n') {
+      lineno++;
+      i++;
+      continue;
+    }
+    if (c == '#') {
+      // an .arc comment, nothing in it is expanded
+      size_t eol = text.find('\n', i);
+      i = eol == std::string_view::npos ? n : eol;
+      continue;
+    }
+    if (std::isdigit(static_cast<unsigned char>(c))) {
+      i = SkipNumber(text, i);
+      continue;
+    }
+    size_t begin = i;
+    i = IdentEnd(text, i);
+    if (i == begin) {
+      i++;
+      continue;
+    }
+    MacroMap::const_iterator macro = macros.find(text.substr(begin, i - begin));
+    if (macro == macros.end() ||
+        std::find(expanding.begin(), expanding.end(), &macro->first) !=
+            expanding.end()) {
+      continue;
+    }
+
+    // name is not written yet, or written to dst at namePos
+    size_t namePos = std::string::npos;
+    while (true) {
+      std::string replaced;
+      int32_t callLines = 0;
+      if (macro->second.functionLike) {
+        size_t open = i;
+        while (open < n &&
+               std::isspace(static_cast<unsigned char>(text[open]))) {
+          open++;
+        }
+        if (open == n || text[open] != '(') {
+          // the name alone is no call, unless the text that follows the
+          // replacement it ends opens one
+          if (open == n) {
+            trailing = macro;
+            trailingPos = namePos != std::string::npos
+                              ? namePos
+                              : dst.size() + (begin - spanBegin);
+          }
+          break;
+        }
+        callLines += std::count(text.begin() + i, text.begin() + open, '\n');
+        if (namePos != std::string::npos) {
+          callLines += std::count(dst.begin() + namePos, dst.end(), '\n');
+          dst.resize(namePos);
+        } else {
+          dst.append(text.substr(spanBegin, begin - spanBegin));
+        }
+        std::vector<std::string> args;
+        size_t argBegin = open + 1, close = argBegin;
+        for (int32_t nesting = 0;; close++) {
+          if (close == n) {
+            Error(file, lineno, "unterminated call of " + macro->first);
+          }
+          char a = text[close];
+          if (a == '(') {
+            nesting++;
+          } else if (a == '\n') {
+            callLines++;
+          } else if ((a == ',' && nesting == 0) || (a == ')' && nesting == 0)) {
+            std::string arg(Trim(text.substr(argBegin, close - argBegin)));
+            std::replace(arg.begin(), arg.end(), '\n', ' ');
+            args.emplace_back(std::move(arg));
+            argBegin = close + 1;
+            if (a == ')') {
+              break;
+            }
+          } else if (a == ')') {
+            nesting--;
+          }
+        }
+        if (macro->second.params.empty() && args.size() == 1 &&
+            args[0].empty()) {
+          args.clear();
+        }
+        if (args.size() != macro->second.params.size()) {
+          Error(file, lineno,
+                StringFormat("%s takes %zu arguments, got %zu",
+                             macro->first.c_str(), macro->second.params.size(),
+                             args.size()));
+        }
+        replaced = Substitute(macro, args, expanding, file, lineno);
+        i = close + 1;
+      } else {
+        dst.append(text.substr(spanBegin, begin - spanBegin));
+        replaced = macro->second.body;
+      }
+
+      trailing = macros.end();
+      expanding.emplace_back(&macro->first);
+      Expand(replaced, dst, expanding, file, lineno);
+      expanding.pop_back();
+      dst.append(callLines, '\n');
+      lineno += callLines;
+      spanBegin = i;
+      // the replacement ended in a function-like name that is not hidden
+      // here, it may take its arguments from the rest of text
+      if (trailing == macros.end() ||
+          std::find(expanding.begin(), expanding.end(), &trailing->first) !=
+              expanding.end()) {
+        trailing = macros.end();
+        break;
+      }
+      macro = trailing;
+      namePos = trailingPos;
+      trailing = macros.end();
+    }
+  }
+  dst.append(text.substr(spanBegin));
+}
+
+// an operand of ## is pasted as written, any other argument is expanded
+std::string SIMPreProcessor::Substitute(
+    MacroMap::const_iterator macro, const std::vector<std::string> &args,
+    std::vector<const std::string *> &expanding, const SIMSource &file,
+    int32_t lineno) {
+  const SIMMacro &def = macro->second;
+  std::string_view body = def.body;
+  std::string ret;
+  bool pasteLeft = false;
+  for (size_t i = 0; i < body.size();) {
+    if (body.compare(i, 2, "##") == 0) {
+      while (!ret.empty() && (ret.back() == ' ' || ret.back() == '\t')) {
+        ret.pop_back();
+      }
+      for (i += 2; i < body.size() && (body[i] == ' ' || body[i] == '\t');) {
+        i++;
+      }
+      pasteLeft = true;
+      continue;
+    }
+    size_t begin = i;
+    if (std::isdigit(static_cast<unsigned char>(body[i]))) {
+      i = SkipNumber(body, i);
+      ret.append(body.substr(begin, i - begin));
+    } else if ((i = IdentEnd(body, i)) != begin) {
+      std::string_view word = body.substr(begin, i - begin);
+      auto param = std::find(def.params.begin(), def.params.end(), word);
+      if (param == def.params.end()) {
+        ret.append(word);
+      } else {
+        const std::string &arg = args[param - def.params.begin()];
+        size_t next = i;
+        while (next < body.size() && (body[next] == ' ' || body[next] == '\t')) {
+          next++;
+        }
+        if (pasteLeft || body.compare(next, 2, "##") == 0) {
+          ret += arg;
+        } else {
+          Expand(arg, ret, expanding, file, lineno);
+        }
+      }
+    } else {
+      ret += body[i++];
+    }
+    pasteLeft = false;
+  }
+  return ret;
+}
+
+// `defined X` and `defined(X)` are resolved before anything is expanded
+bool SIMPreProcessor::Evaluate(const SIMSource &file,
+                               const SIMPreFile::Directive &cond) {
+  std::string_view args = cond.args;
+  std::string resolved;
+  for (size_t i = 0; i < args.size();) {
+    size_t begin = i;
+    if (std::isdigit(static_cast<unsigned char>(args[i]))) {
+      i = SkipNumber(args, i);
+      resolved.append(args.substr(begin, i - begin));
+      continue;
+    }
+    if ((i = IdentEnd(args, i)) == begin) {
+      resolved += args[i++];
+      continue;
+    }
+    if (args.substr(begin, i - begin) != "defined") {
+      resolved.append(args.substr(begin, i - begin));
+      continue;
+    }
+    auto skipBlanks = [&]() {
+      while (i < args.size() && (args[i] == ' ' || args[i] == '\t')) {
+        i++;
+      }
+    };
+    skipBlanks();
+    bool paren = i < args.size() && args[i] == '(';
+    if (paren) {
+      i++;
+      skipBlanks();
+    }
+    size_t nameBegin = i;
+    if ((i = IdentEnd(args, i)) == nameBegin) {
+      Error(file, cond.lineno, "macro name expected after defined");
+    }
+    bool defined =
+        macros.find(args.substr(nameBegin, i - nameBegin)) != macros.end();
+    if (paren) {
+      skipBlanks();
+      if (i == args.size() || args[i] != ')') {
+        Error(file, cond.lineno, "missing ) after defined");
+      }
+      i++;
+    }
+    resolved += defined ? " 1 " : " 0 ";
+  }
+
+  std::string expanded;
+  std::vector<const std::string *> expanding;
+  Expand(resolved, expanded, expanding, file, cond.lineno);
+  try {
+    return SIMPreExpr(expanded).Evaluate() != 0;
+  } catch (const std::logic_error &e) {
+    Error(file, cond.lineno,
+          StringFormat("#%s: %s", kDirectiveNames[cond.kind], e.what()));
+  }
+}
+
+} // namespace XPUSchedulerSimulator
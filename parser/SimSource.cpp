@@ -0,0 +1,99 @@
+#include "SimSource.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace XPUSchedulerSimulator {
+
+SIMSource::~SIMSource() {
+  if (mapping != nullptr) {
+    munmap(mapping, mappingSize);
+  }
+}
+
+bool SIMSource::Map(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  this->path = path;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      madvise(addr, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      mapping = addr;
+      mappingSize = st.st_size;
+      text = std::string_view(static_cast<const char *>(addr), st.st_size);
+      return true;
+    }
+  }
+
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+    if (n > 0) {
+      storage.append(buf, n);
+    }
+  }
+  int readErrno = errno;
+  close(fd);
+  if (n < 0) {
+    errno = readErrno;
+    return false;
+  }
+  text = storage;
+  return true;
+}
+
+void SIMSource::Assign(std::string text) {
+  storage = std::move(text);
+  this->text = storage;
+}
+
+SIMSource::Origin SIMSource::Locate(int32_t lineno) const {
+  auto run = std::upper_bound(
+      lineRuns.begin(), lineRuns.end(), lineno,
+      [](int32_t lineno, const LineRun &run) { return lineno < run.lineno; });
+  if (run == lineRuns.begin()) {
+    return {this, lineno};
+  }
+  --run;
+  return {run->origin.source, run->origin.lineno + lineno - run->lineno};
+}
+
+void SIMSource::MapLines(int32_t lineno, const SIMSource *source,
+                         int32_t sourceLineno) {
+  if (!lineRuns.empty() && lineRuns.back().lineno == lineno) {
+    lineRuns.pop_back();
+  }
+  lineRuns.push_back({lineno, {source, sourceLineno}});
+}
+
+std::string SIMSource::Excerpt(int32_t lineno) const {
+  std::call_once(lineIndexOnce, [this] {
+    lineBegin.emplace_back(0);
+    for (const char *p = text.data(), *end = p + text.size();
+         (p = static_cast<const char *>(std::memchr(p, '\n', end - p)));
+         p++) {
+      lineBegin.emplace_back(p - text.data() + 1);
+    }
+  });
+  size_t first = std::max(lineno - 2, 0);
+  if (first >= lineBegin.size()) {
+    return "";
+  }
+  size_t begin = lineBegin[first];
+  size_t end = first + 3 < lineBegin.size() ? lineBegin[first + 3]
+                                            : text.size();
+  return std::string(text.substr(begin, end - begin));
+}
+
+} // namespace XPUSchedulerSimulator
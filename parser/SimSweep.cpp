@@ -0,0 +1,248 @@
+#include "SimSweep.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace XPUSchedulerSimulator {
+
+// variants a sweep may expand to, so a typo does not run for hours
+static const int64_t kMaxVariantCnt = 1 << 20;
+
+// a device count, or a duration in ns; -1 when text is neither
+static int64_t ParseSweepValue(const SIMSweepAxis &axis,
+                               const std::string &text) {
+  size_t digits = 0;
+  while (digits < text.size() && std::isdigit((unsigned char)text[digits])) {
+    digits++;
+  }
+  if (digits == 0 || digits > 18) {
+    return -1;
+  }
+  if (axis.hardware) {
+    if (digits != text.size()) {
+      return -1;
+    }
+    int64_t cnt = std::stoll(text);
+    return cnt > 0 && cnt <= INT32_MAX ? cnt : -1;
+  }
+  // the DURATION token of the lexer
+  size_t end = digits;
+  if (end < text.size() && text[end] == '.') {
+    size_t fraction = ++end;
+    while (end < text.size() && std::isdigit((unsigned char)text[end])) {
+      end++;
+    }
+    if (end == fraction) {
+      return -1;
+    }
+  }
+  std::string unit = text.substr(end);
+  if (!unit.empty() && unit != "ns" && unit != "us" && unit != "ms" &&
+      unit != "s") {
+    return -1;
+  }
+  return SIMParseDuration(text);
+}
+
+SIMSweepAxis ParseSweepAxis(const SIMTaskGraph &graph,
+                            const std::string &spec) {
+  size_t assign = spec.find('=');
+  if (assign == std::string::npos || assign == 0) {
+    throw std::logic_error("Sweep " + spec + " is not NAME=VALUES");
+  }
+  SIMSweepAxis axis;
+  axis.name = spec.substr(0, assign);
+  axis.hardware = false;
+  for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+    if (graph.hardware[hardware].name == axis.name) {
+      axis.hardware = true;
+      axis.index = hardware;
+    }
+  }
+  int32_t op = graph.FindOperator(axis.name);
+  if (op >= 0 && axis.hardware) {
+    throw std::logic_error(axis.name + " is both a hardware and an operator");
+  } else if (op >= 0) {
+    axis.hardware = false;
+    axis.index = op;
+  } else if (!axis.hardware) {
+    throw std::logic_error("Sweep of unknown hardware or operator " +
+                           axis.name);
+  }
+
+  std::string values = spec.substr(assign + 1);
+  auto Value = [&](const std::string &text) {
+    int64_t value = ParseSweepValue(axis, text);
+    if (value < 0) {
+      throw std::logic_error("Bad " +
+                             std::string(axis.hardware ? "device count"
+                                                       : "duration") +
+                             " " + text + " in sweep of " + axis.name);
+    }
+    return value;
+  };
+  size_t range = values.find("..");
+  if (range == std::string::npos) {
+    size_t begin = 0;
+    while (true) {
+      size_t comma = std::min(values.find(',', begin), values.size());
+      axis.values.emplace_back(Value(values.substr(begin, comma - begin)));
+      if (comma == values.size()) {
+        break;
+      }
+      begin = comma + 1;
+    }
+    return axis;
+  }
+
+  size_t colon = std::min(values.find(':', range), values.size());
+  int64_t lo = Value(values.substr(0, range));
+  int64_t hi = Value(values.substr(range + 2, colon - range - 2));
+  int64_t step = 1;
+  if (colon < values.size()) {
+    step = Value(values.substr(colon + 1));
+  } else if (!axis.hardware) {
+    throw std::logic_error("Sweep of operator " + axis.name +
+                           " needs a step, LO..HI:STEP");
+  }
+  if (lo > hi || step == 0 || (hi - lo) / step >= kMaxVariantCnt) {
+    throw std::logic_error("Bad range " + values + " in sweep of " +
+                           axis.name);
+  }
+  for (int64_t value = lo; value <= hi; value += step) {
+    axis.values.emplace_back(value);
+    if (value > hi - step) {
+      break;
+    }
+  }
+  return axis;
+}
+
+std::vector<SIMSweepVariant> SIMSweep::Run() const {
+  int64_t variantCnt = 1;
+  for (auto &axis : axes) {
+    variantCnt *= axis.values.size();
+    if (variantCnt > kMaxVariantCnt) {
+      throw std::logic_error("Sweep has more than " +
+                             std::to_string(kMaxVariantCnt) + " variants");
+    }
+  }
+  bool retimed = false;
+  for (int32_t a = 0; a < axes.size(); a++) {
+    for (int32_t b = 0; b < a; b++) {
+      if (axes[b].hardware == axes[a].hardware &&
+          axes[b].index == axes[a].index) {
+        throw std::logic_error(axes[a].name + " is swept twice");
+      }
+    }
+    retimed |= !axes[a].hardware;
+  }
+
+  std::vector<SIMSweepVariant> variants(variantCnt);
+  std::vector<SIMTaskGraph> workerGraphs(SIMJobCnt(jobs, variantCnt), graph);
+  SIMParallelFor(variantCnt, jobs, [&](int32_t i, int32_t worker) {
+    SIMTaskGraph &variantGraph = workerGraphs[worker];
+    SIMSweepVariant &variant = variants[i];
+    // undo the previous variant of this worker
+    for (auto &axis : axes) {
+      if (axis.hardware) {
+        variantGraph.hardware[axis.index].cnt = graph.hardware[axis.index].cnt;
+      } else {
+        variantGraph.operators[axis.index].time =
+            graph.operators[axis.index].time;
+      }
+    }
+    variant.values.resize(axes.size());
+    int64_t rest = i;
+    for (int32_t a = axes.size() - 1; a >= 0; a--) {
+      const SIMSweepAxis &axis = axes[a];
+      variant.values[a] = axis.values[rest % axis.values.size()];
+      rest /= axis.values.size();
+      if (axis.hardware) {
+        variantGraph.hardware[axis.index].cnt = variant.values[a];
+      } else {
+        variantGraph.operators[axis.index].time = variant.values[a];
+      }
+    }
+    // ranks are operator times summed along paths
+    if (retimed) {
+      for (auto &flow : variantGraph.flows) {
+        flow.ranked = false;
+      }
+      for (int32_t flow = 0; flow < variantGraph.flows.size(); flow++) {
+        variantGraph.RankFlow(flow);
+      }
+    }
+    for (auto &hardware : variantGraph.hardware) {
+      variant.hardwareCnt.emplace_back(hardware.cnt);
+    }
+    SIMEngine engine(variantGraph);
+    engine.policy = policy;
+    variant.result = engine.Run();
+  });
+  return variants;
+}
+
+void SIMSweep::WriteCSV(const std::vector<SIMSweepVariant> &variants,
+                        std::ostream &os) const {
+  os << "variant";
+  for (auto &axis : axes) {
+    os << "," << axis.name << (axis.hardware ? "" : "_ns");
+  }
+  os << ",makespan,device,busy_time,usage\n";
+  for (int32_t i = 0; i < variants.size(); i++) {
+    const SIMSweepVariant &variant = variants[i];
+    std::string key = std::to_string(i);
+    for (int64_t value : variant.values) {
+      key += "," + std::to_string(value);
+    }
+    double makespan = variant.result.makespan / 1e9;
+    for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+      for (int32_t device = 0; device < variant.hardwareCnt[hardware];
+           device++) {
+        double busy = variant.result.busyTime[hardware][device] / 1e9;
+        os << StringFormat("%s,%.9lf,%s_%d,%.9lf,%.3lf\n", key.c_str(),
+                           makespan, graph.hardware[hardware].name.c_str(),
+                           device, busy,
+                           makespan > 0 ? busy * 100 / makespan : 0.0);
+      }
+    }
+  }
+}
+
+void SIMSweep::WriteJSON(const std::vector<SIMSweepVariant> &variants,
+                         std::ostream &os) const {
+  os << "{\"axes\":[";
+  for (int32_t a = 0; a < axes.size(); a++) {
+    os << (a == 0 ? "" : ",") << "{\"name\":\"" << axes[a].name
+       << "\",\"kind\":\"" << (axes[a].hardware ? "hardware" : "operator")
+       << "\"}";
+  }
+  os << "],\"variants\":[";
+  const char *separator = "\n";
+  for (auto &variant : variants) {
+    os << separator << "{\"values\":[";
+    for (int32_t a = 0; a < variant.values.size(); a++) {
+      os << (a == 0 ? "" : ",") << variant.values[a];
+    }
+    double makespan = variant.result.makespan / 1e9;
+    os << StringFormat("],\"makespan\":%.9lf,\"hardware\":[", makespan);
+    for (int32_t hardware = 0; hardware < graph.hardware.size(); hardware++) {
+      os << (hardware == 0 ? "" : ",") << "{\"name\":\""
+         << graph.hardware[hardware].name << "\",\"usage\":[";
+      for (int32_t device = 0; device < variant.hardwareCnt[hardware];
+           device++) {
+        double busy = variant.result.busyTime[hardware][device] / 1e9;
+        os << StringFormat("%s%.3lf", device == 0 ? "" : ",",
+                           makespan > 0 ? busy * 100 / makespan : 0.0);
+      }
+      os << "]}";
+    }
+    os << "]}";
+    separator = ",\n";
+  }
+  os << "\n]}\n";
+}
+
+} // namespace XPUSchedulerSimulator
@@ -1,60 +1,107 @@
-%parse-param {XPUSchedulerSimulator::SIMTranslationUnit **unit}
+%define api.pure full
+%param {yyscan_t scanner}
+%parse-param {XPUSchedulerSimulator::SIMParseContext *ctx}
 
 %code top {
     #include "SimAST.h"
     #include <iostream>
 
     using namespace XPUSchedulerSimulator;
-    extern int yylex(void);
-    extern int yylineno;
 
-    struct SIMSymbol *g_FlowBlockLeftSymbol;
+    // every node lives in the arena of the unit being parsed
+    template <typename T>
+    static T *NewNode(SIMTranslationUnit *unit) {
+        return unit->arena.New<T>();
+    }
 
-    static void yyerror(XPUSchedulerSimulator::SIMTranslationUnit **unit, const char* s) {
-        fprintf(stderr, "Parse Error In Line %d\n", yylineno);
+    static bool AddBlock(SIMParseContext *ctx, SIMBlock *block) {
+        SIMTranslationUnit *unit = ctx->unit;
+        if (SIMHardwareBlock *hardwareBlock = dynamic_cast<SIMHardwareBlock *>(block)) {
+            unit->hardware = hardwareBlock;
+        } else if (SIMOperatorBlock *operatorBlock = dynamic_cast<SIMOperatorBlock *>(block)) {
+            unit->op = operatorBlock;
+        } else if (SIMSimuBlock *simuBlock = dynamic_cast<SIMSimuBlock *>(block)) {
+            unit->simu = simuBlock;
+        } else if (SIMWindowBlock *windowBlock = dynamic_cast<SIMWindowBlock *>(block)) {
+            unit->window = windowBlock;
+        } else if (SIMFlowBlock *flowBlock = dynamic_cast<SIMFlowBlock *>(block)) {
+            if (!unit->flowBlocks.emplace(ctx->flowBlockName, flowBlock).second) {
+                fprintf(stderr, "Flow %s is defined twice\n", ctx->flowBlockName->name.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+%code requires {
+    #include "SimAST.h"
+
+    #ifndef YY_TYPEDEF_YY_SCANNER_T
+    #define YY_TYPEDEF_YY_SCANNER_T
+    typedef void *yyscan_t;
+    #endif
+}
+
+%code {
+    // the reentrant scanner generated from lexer.l
+    int yylex(YYSTYPE *yylval, yyscan_t scanner);
+    int yyget_lineno(yyscan_t scanner);
+
+    // GenSimAST frees the unit when parsing fails
+    static void yyerror(yyscan_t scanner, SIMParseContext *ctx, const char *s) {
+        // the line of the file it was written in, through any #include
+        SIMSource::Origin origin = ctx->source->Locate(yyget_lineno(scanner));
+        if (origin.source->Path().empty()) {
+            fprintf(stderr, "Parse Error In Line %d: %s\n", origin.lineno, s);
+        } else {
+            fprintf(stderr, "Parse Error In Line %d of %s: %s\n", origin.lineno,
+                    origin.source->Path().c_str(), s);
+        }
         fprintf(stderr, "======= SRC =======\n");
-        fprintf(stderr, "%s", GetSrc(yylineno).c_str());
+        fprintf(stderr, "%s", origin.source->Excerpt(origin.lineno).c_str());
         fprintf(stderr, "===================\n");
-        if (*unit != nullptr) {
-            delete *unit;
-        }
     }
 }
 
 %union {
-    char *str;
     int iVal;
-    double fVal;
-    struct SIMSymbol *symbol;
-    struct SIMFlowExpression *arrowExpr;
-    struct SIMExpression *simExpr;
-    struct SIMOperatorExpr *opDeclExpr;
-    struct SIMHardwareExpr *hardwareDeclExpr;
-    struct SIMBlock *block;
-    struct SIMTranslationUnit *unit;
+    // nanoseconds
+    int64_t nsVal;
+    XPUSchedulerSimulator::SIMSymbol *symbol;
+    XPUSchedulerSimulator::SIMFlowExpression *arrowExpr;
+    XPUSchedulerSimulator::SIMFlowChainExpression *chainExpr;
+    XPUSchedulerSimulator::SIMExpression *simExpr;
+    XPUSchedulerSimulator::SIMOperatorExpr *opDeclExpr;
+    XPUSchedulerSimulator::SIMHardwareExpr *hardwareDeclExpr;
+    XPUSchedulerSimulator::SIMBlock *block;
+    XPUSchedulerSimulator::SIMTranslationUnit *unit;
 }
 
 // Terminals
 
-%token HARDWARE OPERATOR SIMU FOREACH SLEEP ASSIGN LEFT_BIG_PAR RIGHT_BIG_PAR LEFT_SMALL_PAR RIGHT_SMALL_PAR
-%token LEFT_MID_PAR RIGHT_MID_PAR COMMA I_CONSTANT F_CONSTANT SEMI SYMBOL
+%token HARDWARE OPERATOR SIMU FOREACH SLEEP WINDOW ASSIGN LEFT_BIG_PAR RIGHT_BIG_PAR LEFT_SMALL_PAR RIGHT_SMALL_PAR
+%token LEFT_MID_PAR RIGHT_MID_PAR COMMA I_CONSTANT SEMI SYMBOL
+%token<nsVal> DURATION
 
 // Precedence and associativity
 
 %left ARROW
 %left DOT
 
-%type<str> SYMBOL
+%type<symbol> SYMBOL
 %type<iVal> constantExpr
+%type<nsVal> durationExpr
 %type<symbol> varExpr
-%type<arrowExpr> flowDeclarator arrowExpr flowForeachExpr
+%type<arrowExpr> arrowStage flowForeachExpr
+%type<chainExpr> flowDeclarator arrowExpr
 %type<simExpr> simuDeclarator simuExpr
 %type<opDeclExpr> operatorDeclarator
 %type<hardwareDeclExpr> hardwareDeclarator
 %type<block> simuBlock simuDeclaratorList
 %type<block> operatorBlock operatorDeclaratorList
 %type<block> hardwareBlock hardwareDeclaratorList
-%type<block> block flowBlock flowDeclaratorList
+%type<block> block flowBlock flowDeclaratorList windowBlock
 %type<unit> start translationUnit
 
 %%
@@ -63,34 +110,20 @@
 
 start
     : translationUnit {
-        *unit = $1;
         $$ = $1;
     }
 ;
 
 translationUnit
     : block {
-        SIMTranslationUnit *unit = new SIMTranslationUnit;
-        if (SIMHardwareBlock *hardwareBlock = dynamic_cast<SIMHardwareBlock *>($1)) {
-            unit->hardware = hardwareBlock;
-        } else if (SIMOperatorBlock *operatorBlock = dynamic_cast<SIMOperatorBlock *>($1)) {
-            unit->op = operatorBlock;
-        } else if (SIMSimuBlock *simuBlock = dynamic_cast<SIMSimuBlock *>($1)) {
-            unit->simu = simuBlock;
-        } else if (SIMFlowBlock *flowBlock = dynamic_cast<SIMFlowBlock *>($1)) {
-            unit->flowBlocks.emplace(g_FlowBlockLeftSymbol, flowBlock);
+        if (!AddBlock(ctx, $1)) {
+            YYABORT;
         }
-        $$ = unit;
+        $$ = ctx->unit;
     }
     | translationUnit block {
-        if (SIMHardwareBlock *hardwareBlock = dynamic_cast<SIMHardwareBlock *>($2)) {
-            $1->hardware = hardwareBlock;
-        } else if (SIMOperatorBlock *operatorBlock = dynamic_cast<SIMOperatorBlock *>($2)) {
-            $1->op = operatorBlock;
-        } else if (SIMSimuBlock *simuBlock = dynamic_cast<SIMSimuBlock *>($2)) {
-            $1->simu = simuBlock;
-        } else if (SIMFlowBlock *flowBlock = dynamic_cast<SIMFlowBlock *>($2)) {
-            $1->flowBlocks.emplace(g_FlowBlockLeftSymbol, flowBlock);
+        if (!AddBlock(ctx, $2)) {
+            YYABORT;
         }
         $$ = $1;
     }
@@ -109,6 +142,21 @@ block
     | simuBlock {
         $$ = $1;
     }
+    | windowBlock {
+        $$ = $1;
+    }
+;
+
+windowBlock
+    : WINDOW ASSIGN constantExpr SEMI {
+        if ($3 <= 0) {
+            yyerror(scanner, ctx, "window must be at least 1");
+            YYABORT;
+        }
+        SIMWindowBlock *block = NewNode<SIMWindowBlock>(ctx->unit);
+        block->size = $3;
+        $$ = block;
+    }
 ;
 
 simuBlock
@@ -119,7 +167,7 @@ simuBlock
 
 simuDeclaratorList
     : simuDeclarator {
-        SIMSimuBlock *block = new SIMSimuBlock;
+        SIMSimuBlock *block = NewNode<SIMSimuBlock>(ctx->unit);
         block->exprs.emplace_back($1);
         $$ = block;
     }
@@ -134,13 +182,13 @@ simuDeclarator
         $$ = $1;
     }
     | SEMI {
-        SIMCallExpression *expr = new SIMCallExpression;
+        SIMCallExpression *expr = NewNode<SIMCallExpression>(ctx->unit);
         expr->name = nullptr;
         expr->arg0 = 0;
         $$ = expr;
     }
     |  FOREACH LEFT_SMALL_PAR constantExpr RIGHT_SMALL_PAR LEFT_BIG_PAR simuDeclaratorList RIGHT_BIG_PAR {
-        SIMForeachExpression *expr = new SIMForeachExpression;
+        SIMForeachExpression *expr = NewNode<SIMForeachExpression>(ctx->unit);
         expr->loopCnt = $3;
         expr->loopBlock = dynamic_cast<SIMSimuBlock *>($6);
         $$ = expr;
@@ -149,15 +197,14 @@ simuDeclarator
 
 simuExpr
     : varExpr LEFT_SMALL_PAR RIGHT_SMALL_PAR {
-        SIMCallExpression *expr = new SIMCallExpression;
+        SIMCallExpression *expr = NewNode<SIMCallExpression>(ctx->unit);
         expr->name = $1;
         expr->arg0 = 0;
         $$ = expr;
     }
-    | SLEEP LEFT_SMALL_PAR constantExpr RIGHT_SMALL_PAR {
-        SIMCallExpression *expr = new SIMCallExpression;
-        expr->name = new SIMSymbol;
-        expr->name->name = std::string("sleep");
+    | SLEEP LEFT_SMALL_PAR durationExpr RIGHT_SMALL_PAR {
+        SIMCallExpression *expr = NewNode<SIMCallExpression>(ctx->unit);
+        expr->name = ctx->unit->symbols.Intern("sleep");
         expr->arg0 = $3;
         $$ = expr;
     }
@@ -165,14 +212,14 @@ simuExpr
 
 flowBlock
     : varExpr ASSIGN LEFT_BIG_PAR flowDeclaratorList RIGHT_BIG_PAR SEMI {
-        g_FlowBlockLeftSymbol = $1;
+        ctx->flowBlockName = $1;
         $$ = $4;
     }
 ;
 
 flowDeclaratorList
     : flowDeclarator {
-        SIMFlowBlock *block = new SIMFlowBlock;
+        SIMFlowBlock *block = NewNode<SIMFlowBlock>(ctx->unit);
         block->exprs.emplace_back($1);
         $$ = block;
     }
@@ -188,36 +235,33 @@ flowDeclarator
     }
 ;
 
+// left recursion appends to one flat chain, the parser stack stays shallow
 arrowExpr
-    : varExpr {
-        SIMFlowUnaryExpression *expr = new SIMFlowUnaryExpression;
-        expr->opName = $1;
+    : arrowStage {
+        SIMFlowChainExpression *expr = NewNode<SIMFlowChainExpression>(ctx->unit);
+        expr->stages.emplace_back($1);
         $$ = expr;
     }
-    | arrowExpr ARROW varExpr {
-        SIMFlowBinaryExpression *expr = new SIMFlowBinaryExpression;
-        expr->leftExpr = $1;
-        SIMFlowUnaryExpression *rightExpr = new SIMFlowUnaryExpression;
-        rightExpr->opName = $3;
-        expr->rightExpr = rightExpr;
-        $$ = expr;
+    | arrowExpr ARROW arrowStage {
+        $1->stages.emplace_back($3);
+        $$ = $1;
     }
-    | arrowExpr ARROW flowForeachExpr {
-        SIMFlowBinaryExpression *expr = new SIMFlowBinaryExpression;
-        expr->leftExpr = $1;
-        expr->rightExpr = $3;
+;
+
+arrowStage
+    : varExpr {
+        SIMFlowUnaryExpression *expr = NewNode<SIMFlowUnaryExpression>(ctx->unit);
+        expr->opName = $1;
         $$ = expr;
     }
     | flowForeachExpr {
-        SIMForeachExpression *expr = new SIMForeachExpression;
-        expr = (SIMForeachExpression *)$1;
-        $$ = expr;
+        $$ = $1;
     }
 ;
 
 flowForeachExpr
     : FOREACH LEFT_SMALL_PAR constantExpr RIGHT_SMALL_PAR LEFT_BIG_PAR flowDeclaratorList RIGHT_BIG_PAR {
-        SIMForeachExpression *expr = new SIMForeachExpression;
+        SIMForeachExpression *expr = NewNode<SIMForeachExpression>(ctx->unit);
         expr->loopCnt = $3;
         expr->loopBlock = $6;
         $$ = expr;
@@ -238,7 +282,7 @@ operatorBlock
 
 hardwareDeclaratorList
     : hardwareDeclarator {
-        SIMHardwareBlock *block = new SIMHardwareBlock;
+        SIMHardwareBlock *block = NewNode<SIMHardwareBlock>(ctx->unit);
         block->exprs.emplace_back($1);
         $$ = block;
     }
@@ -251,7 +295,7 @@ hardwareDeclaratorList
 
 operatorDeclaratorList
     : operatorDeclarator {
-        SIMOperatorBlock *block = new SIMOperatorBlock;
+        SIMOperatorBlock *block = NewNode<SIMOperatorBlock>(ctx->unit);
         block->exprs.emplace_back($1);
         $$ = block;
     }
@@ -264,7 +308,7 @@ operatorDeclaratorList
 
 hardwareDeclarator
     : varExpr LEFT_SMALL_PAR constantExpr RIGHT_SMALL_PAR COMMA {
-        SIMHardwareExpr *expr = new SIMHardwareExpr;
+        SIMHardwareExpr *expr = NewNode<SIMHardwareExpr>(ctx->unit);
         expr->hardwareName = $1;
         expr->hardwareCnt = $3;
         $$ = expr;
@@ -272,8 +316,8 @@ hardwareDeclarator
 ;
 
 operatorDeclarator
-    : varExpr LEFT_SMALL_PAR varExpr COMMA constantExpr RIGHT_SMALL_PAR COMMA {
-        SIMOperatorExpr *expr = new SIMOperatorExpr;
+    : varExpr LEFT_SMALL_PAR varExpr COMMA durationExpr RIGHT_SMALL_PAR COMMA {
+        SIMOperatorExpr *expr = NewNode<SIMOperatorExpr>(ctx->unit);
         expr->opName = $1;
         expr->hardwareName = $3;
         expr->time = $5;
@@ -283,9 +327,7 @@ operatorDeclarator
 
 varExpr
     : SYMBOL {
-        SIMSymbol *symbol = new SIMSymbol;
-        symbol->name = std::string(yylval.str);
-        $$ = symbol;
+        $$ = $1;
     }
 ;
 
@@ -295,4 +337,18 @@ constantExpr
     }
 ;
 
+durationExpr
+    : constantExpr {
+        // a plain number is milliseconds
+        $$ = $1 * INT64_C(1000000);
+    }
+    | DURATION {
+        if ($1 < 0) {
+            yyerror(scanner, ctx, "duration out of range");
+            YYABORT;
+        }
+        $$ = $1;
+    }
+;
+
 %%